@@ -0,0 +1,457 @@
+#pragma once
+#include <mbed.h>
+
+// Tables and helpers for the decoder (RFC 1950/1951).
+class Deflate
+{
+public:
+    static constexpr uint16_t LENGTH_BASE[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+    static constexpr uint8_t LENGTH_EXTRA[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static constexpr uint16_t DIST_BASE[30]={1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+    static constexpr uint8_t DIST_EXTRA[30]={0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+    // True if the two bytes start a zlib stream. ESP images start with 0xE9
+    // and never match.
+    static bool isZlibHeader(const uint8_t *head)
+    {
+        return (head[0]&0x0F)==8 && (head[0]>>4)<=7 && (head[1]&0x20)==0 && ((head[0]<<8)|head[1])%31==0;
+    }
+
+    // The window the stream was made with, from its CINFO field. No match
+    // reaches further back than this.
+    static uint32_t windowSize(const uint8_t *head)
+    {
+        return 1u<<((head[0]>>4)+8);
+    }
+};
+
+
+// Decodes a zlib stream from a file a piece at a time, so
+// the caller can go on with other work in between. Without a window only the
+// length is tracked, so a pre-deflated image can be sized whatever window it
+// was made with. read() needs the output history for matches: it takes a
+// window, and only a stream whose header asks for no more than that.
+class Inflater
+{
+public:
+    static constexpr int MAX_BITS=15;
+
+    Inflater(FileHandle *file);
+
+    // windowSize must be a power of two.
+    void setWindow(uint8_t *window, const uint32_t windowSize);
+
+    // Fill dst with up to size inflated bytes, from where the last call
+    // stopped. Needs a window. Returns less than size only at the end of the
+    // stream or on an error; done() and failed() tell which.
+    size_t read(void *dst, const size_t size);
+    // Inflate up to size bytes and drop them. Works without a window.
+    uint32_t skip(const uint32_t size);
+    // Decode the rest of the stream. Returns the inflated size, or 0 on a corrupt stream.
+    uint32_t run(void);
+
+    bool done(void) const { return m_state==STATE_DONE; }
+    bool failed(void) const { return m_error; }
+    uint32_t inflated(void) const { return m_outCount; }
+    // Compressed bytes decoded so far.
+    uint32_t consumed(void) const { return m_consumed; }
+
+private:
+    enum eState: uint8_t
+    {
+        STATE_HEAD,
+        STATE_BLOCK,    // At the start of a block, or past the last one.
+        STATE_STORED,
+        STATE_CODES,
+        STATE_DONE,
+    };
+
+    FileHandle *m_file;
+    uint8_t *m_window;
+    uint32_t m_windowSize;
+    uint8_t *m_dst;// Where the call in progress puts its output, if anywhere.
+    uint8_t m_in[64];
+    uint32_t m_inPos;
+    uint32_t m_inLen;
+    uint32_t m_consumed;
+    uint32_t m_bitBuf;
+    uint8_t m_bitCount;
+    bool m_error;
+    eState m_state;
+    bool m_last;// The block in progress is the final one.
+    uint32_t m_storedLeft;
+    // A match that didn't fit in the last call's output.
+    uint32_t m_copyLen;
+    uint32_t m_copyDist;
+    uint32_t m_outCount;
+    int16_t m_lenCount[MAX_BITS+1];
+    int16_t m_lenSymbol[288];
+    int16_t m_distCount[MAX_BITS+1];
+    int16_t m_distSymbol[30];
+
+    uint32_t m_inflate(uint8_t *dst, const uint32_t size);
+    int m_byte(void);
+    void m_put(const uint8_t byte);
+    void m_copy(const uint32_t len);
+    uint32_t m_getBits(const uint8_t count);
+    int m_decode(const int16_t *count, const int16_t *symbol);
+    bool m_construct(int16_t *count, int16_t *symbol, const uint8_t *lengths, const int n);
+    void m_head(void);
+    void m_block(void);
+    bool m_stored(void);
+    bool m_fixed(void);
+    bool m_dynamic(void);
+    void m_codes(const uint32_t room);
+};
+
+
+Inflater::Inflater(FileHandle *file): m_file(file), m_window(nullptr), m_windowSize(0), m_dst(nullptr),
+    m_inPos(0), m_inLen(0), m_consumed(0), m_bitBuf(0), m_bitCount(0), m_error(false), m_state(STATE_HEAD), m_last(false),
+    m_storedLeft(0), m_copyLen(0), m_copyDist(0), m_outCount(0)
+{
+}
+
+void Inflater::setWindow(uint8_t *window, const uint32_t windowSize)
+{
+    m_window=window;
+    m_windowSize=windowSize;
+}
+
+size_t Inflater::read(void *dst, const size_t size)
+{
+    if(!m_window)
+    {
+        m_error=true;
+        return 0;
+    }
+    return m_inflate(reinterpret_cast<uint8_t*>(dst), size);
+}
+
+uint32_t Inflater::skip(const uint32_t size)
+{
+    return m_inflate(nullptr, size);
+}
+
+uint32_t Inflater::run(void)
+{
+    m_inflate(nullptr, 0xFFFFFFFF);
+    return (done() && !m_error) ? m_outCount : 0;
+}
+
+// Runs the decoder until size bytes came out or the stream ends. It stops
+// between symbols, or inside a stored run or a match, and the state says
+// where to go on from.
+uint32_t Inflater::m_inflate(uint8_t *dst, const uint32_t size)
+{
+    m_dst=dst;
+    uint32_t start=m_outCount;
+    while(!m_error && m_state!=STATE_DONE && m_outCount-start<size)
+    {
+        uint32_t room=size-(m_outCount-start);
+        switch(m_state)
+        {
+            case STATE_HEAD:
+                m_head();
+                break;
+            case STATE_BLOCK:
+                m_block();
+                break;
+            case STATE_STORED:
+            {
+                uint32_t count=(m_storedLeft<room) ? m_storedLeft : room;
+                for(uint32_t i=0;i<count && !m_error;i++)
+                    m_put(m_byte());
+                m_storedLeft-=count;
+                if(m_storedLeft==0)
+                    m_state=STATE_BLOCK;
+                break;
+            }
+            case STATE_CODES:
+                m_codes(room);
+                break;
+            default:
+                break;
+        }
+    }
+    m_dst=nullptr;
+    return m_outCount-start;
+}
+
+int Inflater::m_byte(void)
+{
+    if(m_inPos==m_inLen)
+    {
+        int count=m_file->read(m_in, sizeof(m_in));
+        if(count<=0)
+        {
+            m_error=true;
+            return 0;
+        }
+        m_inPos=0;
+        m_inLen=count;
+    }
+    m_consumed++;
+    return m_in[m_inPos++];
+}
+
+void Inflater::m_put(const uint8_t byte)
+{
+    if(m_window)
+        m_window[m_outCount&(m_windowSize-1)]=byte;
+    if(m_dst)
+        *m_dst++=byte;
+    m_outCount++;
+}
+
+// Without a window there is nothing to copy from, only the length counts.
+void Inflater::m_copy(const uint32_t len)
+{
+    if(!m_window)
+    {
+        m_outCount+=len;
+        return;
+    }
+    for(uint32_t i=0;i<len;i++)
+        m_put(m_window[(m_outCount-m_copyDist)&(m_windowSize-1)]);
+}
+
+uint32_t Inflater::m_getBits(const uint8_t count)
+{
+    while(m_bitCount<count)
+    {
+        m_bitBuf|=m_byte()<<m_bitCount;
+        m_bitCount+=8;
+    }
+    uint32_t value=m_bitBuf&((1u<<count)-1);
+    m_bitBuf>>=count;
+    m_bitCount-=count;
+    return value;
+}
+
+// Canonical Huffman decode, one bit at a time (as in zlib's puff.c).
+int Inflater::m_decode(const int16_t *count, const int16_t *symbol)
+{
+    int code=0;
+    int first=0;
+    int index=0;
+    for(int len=1;len<=MAX_BITS;len++)
+    {
+        code|=m_getBits(1);
+        int c=count[len];
+        if(code-c<first)
+            return symbol[index+(code-first)];
+        index+=c;
+        first+=c;
+        first<<=1;
+        code<<=1;
+        if(m_error)
+            return -1;
+    }
+    return -1;
+}
+
+bool Inflater::m_construct(int16_t *count, int16_t *symbol, const uint8_t *lengths, const int n)
+{
+    for(int len=0;len<=MAX_BITS;len++)
+        count[len]=0;
+    for(int s=0;s<n;s++)
+        count[lengths[s]]++;
+    if(count[0]==n)
+        return true;
+
+    // Reject over-subscribed code sets.
+    int left=1;
+    for(int len=1;len<=MAX_BITS;len++)
+    {
+        left<<=1;
+        left-=count[len];
+        if(left<0)
+            return false;
+    }
+
+    int16_t offs[MAX_BITS+1];
+    offs[1]=0;
+    for(int len=1;len<MAX_BITS;len++)
+        offs[len+1]=offs[len]+count[len];
+    for(int s=0;s<n;s++)
+        if(lengths[s]!=0)
+            symbol[offs[lengths[s]]++]=s;
+    return true;
+}
+
+// A stream made with a bigger window than ours could reach past it.
+void Inflater::m_head(void)
+{
+    uint8_t head[2];
+    head[0]=m_byte();
+    head[1]=m_byte();
+    if(m_error || !Deflate::isZlibHeader(head) || (m_window && Deflate::windowSize(head)>m_windowSize))
+        m_error=true;
+    else
+        m_state=STATE_BLOCK;
+}
+
+void Inflater::m_block(void)
+{
+    if(m_last)
+    {
+        m_state=STATE_DONE;
+        return;
+    }
+    m_last=m_getBits(1);
+    bool ok;
+    switch(m_getBits(2))
+    {
+        case 0: ok=m_stored(); break;
+        case 1: ok=m_fixed(); break;
+        case 2: ok=m_dynamic(); break;
+        default: ok=false;
+    }
+    if(!ok)
+        m_error=true;
+}
+
+bool Inflater::m_stored(void)
+{
+    // Drop the bits left in the current byte.
+    m_bitBuf=0;
+    m_bitCount=0;
+
+    uint32_t len=m_byte();
+    len|=m_byte()<<8;
+    uint32_t nlen=m_byte();
+    nlen|=m_byte()<<8;
+    if(len!=(~nlen&0xFFFF))
+        return false;
+    m_storedLeft=len;
+    m_state=STATE_STORED;
+    return true;
+}
+
+bool Inflater::m_fixed(void)
+{
+    uint8_t lengths[288];
+    int s=0;
+    for(;s<144;s++) lengths[s]=8;
+    for(;s<256;s++) lengths[s]=9;
+    for(;s<280;s++) lengths[s]=7;
+    for(;s<288;s++) lengths[s]=8;
+    m_construct(m_lenCount, m_lenSymbol, lengths, 288);
+
+    for(s=0;s<30;s++) lengths[s]=5;
+    m_construct(m_distCount, m_distSymbol, lengths, 30);
+
+    m_state=STATE_CODES;
+    return true;
+}
+
+bool Inflater::m_dynamic(void)
+{
+    static constexpr uint8_t order[19]={16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+    uint8_t lengths[286+30];
+
+    int nlen=m_getBits(5)+257;
+    int ndist=m_getBits(5)+1;
+    int ncode=m_getBits(4)+4;
+    if(nlen>286 || ndist>30)
+        return false;
+
+    int index=0;
+    for(;index<ncode;index++)
+        lengths[order[index]]=m_getBits(3);
+    for(;index<19;index++)
+        lengths[order[index]]=0;
+    if(m_error || !m_construct(m_lenCount, m_lenSymbol, lengths, 19))
+        return false;
+
+    index=0;
+    while(index<nlen+ndist)
+    {
+        int symbol=m_decode(m_lenCount, m_lenSymbol);
+        if(symbol<0)
+            return false;
+        if(symbol<16)
+        {
+            lengths[index++]=symbol;
+            continue;
+        }
+
+        uint8_t len=0;
+        int repeat;
+        if(symbol==16)
+        {
+            if(index==0)
+                return false;
+            len=lengths[index-1];
+            repeat=3+m_getBits(2);
+        }
+        else if(symbol==17)
+            repeat=3+m_getBits(3);
+        else
+            repeat=11+m_getBits(7);
+        if(index+repeat>nlen+ndist)
+            return false;
+        while(repeat--)
+            lengths[index++]=len;
+    }
+
+    // The end-of-block code must exist.
+    if(lengths[256]==0)
+        return false;
+    if(!m_construct(m_lenCount, m_lenSymbol, lengths, nlen))
+        return false;
+    if(!m_construct(m_distCount, m_distSymbol, lengths+nlen, ndist))
+        return false;
+
+    m_state=STATE_CODES;
+    return true;
+}
+
+// One symbol, or as much of a pending match as fits in room.
+void Inflater::m_codes(const uint32_t room)
+{
+    if(m_copyLen)
+    {
+        uint32_t count=(m_copyLen<room) ? m_copyLen : room;
+        m_copy(count);
+        m_copyLen-=count;
+        return;
+    }
+
+    int symbol=m_decode(m_lenCount, m_lenSymbol);
+    if(symbol<0 || m_error)
+    {
+        m_error=true;
+        return;
+    }
+
+    if(symbol<256)
+        m_put(symbol);
+    else if(symbol==256)
+        m_state=STATE_BLOCK;
+    else
+    {
+        symbol-=257;
+        if(symbol>=29)
+        {
+            m_error=true;
+            return;
+        }
+        uint32_t len=Deflate::LENGTH_BASE[symbol]+m_getBits(Deflate::LENGTH_EXTRA[symbol]);
+
+        int d=m_decode(m_distCount, m_distSymbol);
+        if(d<0 || d>=30)
+        {
+            m_error=true;
+            return;
+        }
+        uint32_t dist=Deflate::DIST_BASE[d]+m_getBits(Deflate::DIST_EXTRA[d]);
+        if(dist>m_outCount || (m_window && dist>m_windowSize))
+        {
+            m_error=true;
+            return;
+        }
+        m_copyLen=len;
+        m_copyDist=dist;
+    }
+}
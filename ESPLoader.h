@@ -1,5 +1,6 @@
 #pragma once
 #include <mbed.h>
+#include "FlashLayout.h"
 
 struct sSlipHeader
 {
@@ -12,113 +13,429 @@ struct sSlipHeader
 class SLIP
 {
 public:
+    // One pass over a payload: the XOR of its bytes and where the bytes that
+    // need escaping are, so sending it doesn't have to look at it again.
+    struct sFrameScan
+    {
+        static constexpr uint32_t MAX_ESCAPES=32;
+        uint8_t Checksum;
+        uint32_t Escapes;   // May be more than MAX_ESCAPES; the rest aren't listed.
+        uint16_t Offset[MAX_ESCAPES];
+    };
 
     static constexpr uint8_t FRAME_DELIMITER=0xC0;
+    // Transmit ring drained by the UART THRE interrupt. Power of two.
+    static constexpr uint32_t TX_BUFFER_SIZE=512;
+    static constexpr uint32_t TX_FIFO_SIZE=16;
+    static constexpr uint32_t LSR_RDR=0x01;
+    static constexpr uint32_t LSR_THRE=0x20;
+    static constexpr uint32_t LSR_TEMT=0x40;
+    // Receive ring filled by the UART RX interrupt. Power of two.
+    static constexpr uint32_t RX_BUFFER_SIZE=256;
+    // Largest decoded frame: a command header and the longest reply body.
+    static constexpr uint32_t RX_FRAME_SIZE=0x80;
     
     static void setUART(Serial* uart);
+    static void flush(void);
+    static bool flushRX(void);
+    static bool rxPending(void);
     static void sendFrameDelimiter(void);
     static void sendFrameByte(uint8_t byte);
     static void sendFrameBuf(const void *data, const size_t size);
+    static void scanFrameBuf(const void *data, const size_t size, sFrameScan &scan);
+    static void sendScannedBuf(const void *data, const size_t size, const sFrameScan &scan);
     static void sendPacket(const sSlipHeader &head, const void *data);
-    static uint8_t recvFrameByte(void);
-    static bool recvPacket(sSlipHeader &header, uint8_t *data, const size_t size);
+    static bool recvPacket(sSlipHeader &header, uint8_t *data, const size_t size, const uint32_t timeout);
     
 private:
+    enum eRxState: uint8_t
+    {
+        RX_IDLE,    // Waiting for a frame delimiter.
+        RX_FRAME,
+        RX_ESCAPE,  // Last byte was 0xDB.
+    };
+    
     static Serial* m_puart;
+    static uint8_t m_txBuf[TX_BUFFER_SIZE];
+    static volatile uint32_t m_txHead;
+    static volatile uint32_t m_txTail;
+    static uint8_t m_rxBuf[RX_BUFFER_SIZE];
+    static volatile uint32_t m_rxHead;
+    static volatile uint32_t m_rxTail;
+    static volatile bool m_rxOverrun;
+    static uint8_t m_frame[RX_FRAME_SIZE];
+    static uint32_t m_frameSize;
+    static bool m_frameReady;
+    static eRxState m_rxState;
+    
+    static void m_txPut(const uint8_t byte);
+    static void m_txWrite(const uint8_t *data, uint32_t size);
+    static void m_txEscape(const uint8_t byte);
+    static bool m_isEscape(const uint8_t byte) { return byte==FRAME_DELIMITER || byte==0xDB; }
+    static bool m_hasEscape(const uint32_t word);
+    static void m_txIrq(void);
+    static void m_rxIrq(void);
+    static void m_wake(void);
+    static bool m_decode(void);
+    static bool m_waitFrame(const uint32_t timeout);
+    static void m_releaseFrame(void);
 };
 
 Serial* SLIP::m_puart=nullptr;
+uint8_t SLIP::m_txBuf[SLIP::TX_BUFFER_SIZE];
+volatile uint32_t SLIP::m_txHead=0;
+volatile uint32_t SLIP::m_txTail=0;
+uint8_t SLIP::m_rxBuf[SLIP::RX_BUFFER_SIZE];
+volatile uint32_t SLIP::m_rxHead=0;
+volatile uint32_t SLIP::m_rxTail=0;
+volatile bool SLIP::m_rxOverrun=false;
+uint8_t SLIP::m_frame[SLIP::RX_FRAME_SIZE];
+uint32_t SLIP::m_frameSize=0;
+bool SLIP::m_frameReady=false;
+SLIP::eRxState SLIP::m_rxState=SLIP::RX_IDLE;
 
+// The ESP is on USART0 (USBTX/USBRX). The interrupt handler writes its
+// registers directly to fill the whole FIFO, which Serial::putc can't do.
 void SLIP::setUART(Serial* uart)
 {
+    if(m_puart)
+    {
+        flush();
+        m_puart->attach(nullptr, Serial::TxIrq);
+        m_puart->attach(nullptr, Serial::RxIrq);
+        
+        // Leave USART0 quiet: no interrupt sources, nothing in the RX FIFO
+        // and nothing pending, for whoever sets it up next.
+        LPC_USART0->IER=0;
+        while(LPC_USART0->LSR & LSR_RDR)
+            (void)LPC_USART0->RBR;
+        NVIC_ClearPendingIRQ(USART0_IRQn);
+    }
     m_puart=uart;
+    flushRX();
+    if(m_puart)
+    {
+        m_puart->attach(&SLIP::m_txIrq, Serial::TxIrq);
+        m_puart->attach(&SLIP::m_rxIrq, Serial::RxIrq);
+    }
 };
 
-void SLIP::sendFrameDelimiter(void)
+// Wait until every queued byte has left the shift register.
+void SLIP::flush(void)
 {
-    m_puart->putc(FRAME_DELIMITER);
+    while(m_txTail!=m_txHead);
+    while(!(LPC_USART0->LSR & LSR_TEMT));
 };
 
-void SLIP::sendFrameByte(uint8_t byte)
+// Drop everything received so far, including a partly decoded frame.
+// Returns true if there was anything to drop.
+bool SLIP::flushRX(void)
+{
+    bool dropped=m_rxTail!=m_rxHead || m_rxOverrun || m_frameSize>0 || m_frameReady;
+    m_rxTail=m_rxHead;
+    m_rxOverrun=false;
+    m_rxState=RX_IDLE;
+    m_frameSize=0;
+    m_frameReady=false;
+    return dropped;
+};
+
+// True once any part of a reply has arrived.
+bool SLIP::rxPending(void)
+{
+    return m_decode() || m_frameSize>0;
+};
+
+void SLIP::m_txPut(const uint8_t byte)
 {
-    if(byte==FRAME_DELIMITER)
+    m_txWrite(&byte, 1);
+};
+
+// Copy a run of bytes into the ring with memcpy, in as few pieces as the
+// wrap and the free space allow.
+void SLIP::m_txWrite(const uint8_t *data, uint32_t size)
+{
+    while(size>0)
     {
-        m_puart->putc(0xDB);
-        m_puart->putc(0xDC);
+        // Wait for room. The interrupt drains the ring.
+        uint32_t room=(m_txTail-m_txHead-1)&(TX_BUFFER_SIZE-1);
+        if(room==0)
+            continue;
+        uint32_t run=TX_BUFFER_SIZE-m_txHead;
+        if(run>room)
+            run=room;
+        if(run>size)
+            run=size;
+        std::memcpy(m_txBuf+m_txHead, data, run);
+        data+=run;
+        size-=run;
+        
+        __disable_irq();
+        m_txHead=(m_txHead+run)&(TX_BUFFER_SIZE-1);
+        // Idle line: fill the FIFO directly. THRE then fires when it has
+        // drained and keeps it going.
+        if(LPC_USART0->LSR & LSR_THRE)
+            m_txIrq();
+        __enable_irq();
     }
-    else if(byte==0xDB)
+};
+
+void SLIP::m_txEscape(const uint8_t byte)
+{
+    const uint8_t escaped[2]={0xDB, (byte==FRAME_DELIMITER) ? (uint8_t)0xDC : (uint8_t)0xDD};
+    m_txWrite(escaped, 2);
+};
+
+// True if any byte of the word is 0xC0 or 0xDB.
+bool SLIP::m_hasEscape(const uint32_t word)
+{
+    uint32_t c0=word^0xC0C0C0C0;
+    uint32_t db=word^0xDBDBDBDB;
+    return (((c0-0x01010101)&~c0) | ((db-0x01010101)&~db)) & 0x80808080;
+};
+
+// THRE: the FIFO is empty, so it takes TX_FIFO_SIZE bytes in one go.
+void SLIP::m_txIrq(void)
+{
+    for(uint32_t i=0;i<TX_FIFO_SIZE && m_txTail!=m_txHead;i++)
     {
-        m_puart->putc(0xDB);
-        m_puart->putc(0xDD);
+        LPC_USART0->THR=m_txBuf[m_txTail];
+        m_txTail=(m_txTail+1)&(TX_BUFFER_SIZE-1);
+    }
+};
+
+void SLIP::m_rxIrq(void)
+{
+    while(LPC_USART0->LSR & LSR_RDR)
+    {
+        uint8_t byte=LPC_USART0->RBR;
+        uint32_t next=(m_rxHead+1)&(RX_BUFFER_SIZE-1);
+        if(next==m_rxTail)
+            m_rxOverrun=true;
+        else
+        {
+            m_rxBuf[m_rxHead]=byte;
+            m_rxHead=next;
+        }
+    }
+};
+
+// Only there so the deadline Timeout ends a WFI.
+void SLIP::m_wake(void)
+{
+};
+
+// Run queued bytes through the SLIP state machine. It stops at the end of a
+// frame so the bytes of the next one stay queued, and resumes from where it
+// left off on the next call.
+bool SLIP::m_decode(void)
+{
+    if(m_rxOverrun)
+    {
+        // Bytes were lost, so the frame being decoded is broken.
+        m_rxOverrun=false;
+        m_rxState=RX_IDLE;
+        m_frameSize=0;
     }
-    else
-        m_puart->putc(byte);
     
+    while(!m_frameReady && m_rxTail!=m_rxHead)
+    {
+        uint8_t byte=m_rxBuf[m_rxTail];
+        m_rxTail=(m_rxTail+1)&(RX_BUFFER_SIZE-1);
+        
+        switch(m_rxState)
+        {
+        case RX_IDLE:
+            if(byte==FRAME_DELIMITER)
+            {
+                m_rxState=RX_FRAME;
+                m_frameSize=0;
+            }
+            break;
+            
+        case RX_FRAME:
+            if(byte==FRAME_DELIMITER)
+                m_frameReady=m_frameSize>0;// Back to back delimiters open a new frame.
+            else if(byte==0xDB)
+                m_rxState=RX_ESCAPE;
+            else if(m_frameSize<RX_FRAME_SIZE)
+                m_frame[m_frameSize++]=byte;
+            else
+                m_rxState=RX_IDLE;// Too long, drop it.
+            break;
+            
+        case RX_ESCAPE:
+            if((byte==0xDC || byte==0xDD) && m_frameSize<RX_FRAME_SIZE)
+            {
+                m_frame[m_frameSize++]=(byte==0xDC) ? 0xC0 : 0xDB;
+                m_rxState=RX_FRAME;
+            }
+            else
+                m_rxState=RX_IDLE;
+            break;
+        }
+    }
+    return m_frameReady;
+};
+
+// Sleep until a whole frame is decoded or the deadline passes. WFI with
+// interrupts masked still wakes on a pending interrupt, so a byte that comes
+// in between the check and the WFI is not missed. A Timeout provides the
+// wakeup at the deadline.
+bool SLIP::m_waitFrame(const uint32_t timeout)
+{
+    flush();
+    Timeout deadline;
+    uint32_t start=Pokitto::Core::getTime();
+    deadline.attach_us(&SLIP::m_wake, timeout*1000);
+    
+    while(!m_decode())
+    {
+        if(Pokitto::Core::getTime()-start >= timeout)
+            break;
+        __disable_irq();
+        if(m_rxTail==m_rxHead && !m_rxOverrun)
+            __WFI();
+        __enable_irq();
+    }
+    deadline.detach();
+    return m_frameReady;
+};
+
+void SLIP::m_releaseFrame(void)
+{
+    m_frameReady=false;
+    m_frameSize=0;
+    m_rxState=RX_FRAME;// The closing delimiter may open the next frame.
+};
+
+void SLIP::sendFrameDelimiter(void)
+{
+    m_txPut(FRAME_DELIMITER);
 };
 
+void SLIP::sendFrameByte(uint8_t byte)
+{
+    if(m_isEscape(byte))
+        m_txEscape(byte);
+    else
+        m_txPut(byte);
+};
+
+// Returns as soon as the escaped bytes are queued.
 void SLIP::sendFrameBuf(const void *data, size_t size)
 {
     const uint8_t *buf_c = reinterpret_cast<const uint8_t *>(data);
-    for(int i = 0; i < size; i++)
-        sendFrameByte(buf_c[i]);
+    size_t from=0;
+    for(size_t i = 0; i < size; i++)
+    {
+        if(m_isEscape(buf_c[i]))
+        {
+            m_txWrite(buf_c+from, i-from);
+            m_txEscape(buf_c[i]);
+            from=i+1;
+        }
+    }
+    m_txWrite(buf_c+from, size-from);
 }
 
-void SLIP::sendPacket(const sSlipHeader &head, const void *data)
+// Checksum and escape positions in one pass, a word at a time once the
+// pointer is aligned (the M0+ can't load unaligned words).
+void SLIP::scanFrameBuf(const void *data, const size_t size, sFrameScan &scan)
 {
-    sendFrameDelimiter();
-    sendFrameBuf(&head, sizeof(sSlipHeader));
-    sendFrameBuf(data, head.Size);
-    sendFrameDelimiter();
+    const uint8_t *buf_c = reinterpret_cast<const uint8_t *>(data);
+    uint32_t sum=0;
+    size_t i=0;
+    scan.Escapes=0;
+    
+    auto scanByte=[&](size_t at)
+    {
+        sum^=buf_c[at];
+        if(m_isEscape(buf_c[at]))
+        {
+            if(scan.Escapes<sFrameScan::MAX_ESCAPES)
+                scan.Offset[scan.Escapes]=at;
+            scan.Escapes++;
+        }
+    };
+    
+    for(; i<size && (reinterpret_cast<uintptr_t>(buf_c+i)&3); i++)
+        scanByte(i);
+    for(; i+4<=size; i+=4)
+    {
+        uint32_t word=*reinterpret_cast<const uint32_t*>(buf_c+i);
+        sum^=word;
+        if(m_hasEscape(word))
+        {
+            for(size_t j=i; j<i+4; j++)
+            {
+                if(m_isEscape(buf_c[j]))
+                {
+                    if(scan.Escapes<sFrameScan::MAX_ESCAPES)
+                        scan.Offset[scan.Escapes]=j;
+                    scan.Escapes++;
+                }
+            }
+        }
+    }
+    for(; i<size; i++)
+        scanByte(i);
+    
+    // XOR is per byte, so the four lanes fold together.
+    sum^=sum>>16;
+    sum^=sum>>8;
+    scan.Checksum=sum;
 }
 
-uint8_t SLIP::recvFrameByte(void)
+// Send a payload scanned by scanFrameBuf: runs between the listed escapes go
+// into the ring with memcpy.
+void SLIP::sendScannedBuf(const void *data, const size_t size, const sFrameScan &scan)
 {
-    uint8_t byte=m_puart->getc();
-    if(byte==0xDB)
+    const uint8_t *buf_c = reinterpret_cast<const uint8_t *>(data);
+    uint32_t listed=scan.Escapes<sFrameScan::MAX_ESCAPES ? scan.Escapes : sFrameScan::MAX_ESCAPES;
+    size_t from=0;
+    for(uint32_t k=0; k<listed; k++)
     {
-        uint8_t byte2=m_puart->getc();
-        if(byte2==0xDC)
-            return 0xC0;
-        if(byte2==0xDD)
-            return 0xDB;
-        return -1;
+        size_t at=scan.Offset[k];
+        m_txWrite(buf_c+from, at-from);
+        m_txEscape(buf_c[at]);
+        from=at+1;
     }
+    if(scan.Escapes>listed)
+        sendFrameBuf(buf_c+from, size-from);// Ran out of list, look for the rest.
     else
-        return byte;
-};
+        m_txWrite(buf_c+from, size-from);
+}
+
+void SLIP::sendPacket(const sSlipHeader &head, const void *data)
+{
+    sendFrameDelimiter();
+    sendFrameBuf(&head, sizeof(sSlipHeader));
+    sendFrameBuf(data, head.Size);
+    sendFrameDelimiter();
+}
 
-bool SLIP::recvPacket(sSlipHeader &header, uint8_t *data, const size_t size)
+bool SLIP::recvPacket(sSlipHeader &header, uint8_t *data, const size_t size, const uint32_t timeout)
 {
-    uint32_t timeout=20000;
-    size_t start=Pokitto::Core::getTime();
-    while((Pokitto::Core::getTime()-start) < timeout)
+    if(!m_waitFrame(timeout))
+        return false;
+    
+    bool ok=false;
+    if(m_frameSize>=sizeof(sSlipHeader))
     {
-        if(m_puart->readable()>0)
+        std::memcpy(&header, m_frame, sizeof(sSlipHeader));
+        if(header.Size<=size && sizeof(sSlipHeader)+header.Size<=m_frameSize)
         {
-            uint8_t byte=m_puart->getc();
-            if(byte==FRAME_DELIMITER)
-            {
-                Pokitto::Display::update();
-                uint8_t* pHeader=reinterpret_cast<uint8_t*>(&header);
-                for(int i=0;i<sizeof(sSlipHeader);i++)
-                    pHeader[i]=recvFrameByte();
-                if(size < header.Size)
-                    return false;
-                for(int i=0;i<header.Size;i++)
-                    data[i]=recvFrameByte();
-                if(byte==FRAME_DELIMITER)
-                    return true;
-                else
-                    return false;
-            }
-            else
-                return false;
+            std::memcpy(data, m_frame+sizeof(sSlipHeader), header.Size);
+            ok=true;
         }
     }
-    return false;
+    m_releaseFrame();
+    return ok;
 };
 
 
+
 class ESPLoader
 {
 public:
@@ -134,52 +451,270 @@ public:
         SYNC        = 0x08,
         WRITE_REG   = 0x09,
         READ_REG    = 0x0a,
+        SPI_SET_PARAMS = 0x0b,
     };
     static constexpr uint8_t ROM_INVALID_RECV_MSG=0xD4;
     static constexpr uint32_t FLASH_WRITE_SIZE=0x400;//1 KB
     static constexpr uint8_t ESP_CHECKSUM_MAGIC=0xEF;
     
-    static constexpr uint32_t FLASH_SECTOR_SIZE=0x1000;
+    static constexpr uint32_t FLASH_SECTOR_SIZE=FlashLayout::SECTOR_SIZE;
+    static constexpr uint32_t FLASH_BLOCK_SIZE=FlashLayout::BLOCK_SIZE;
+    static constexpr uint32_t FLASH_PAGE_SIZE=0x100;
+    // Worst case erase times from common SPI NOR datasheets, in ms.
+    static constexpr uint32_t ERASE_SECTOR_MS=400;
+    static constexpr uint32_t ERASE_BLOCK_MS=2000;
+    
+    // SPI0 registers driven over WRITE_REG/READ_REG to send the flash chip
+    // its own commands, as esptool does.
+    static constexpr uint32_t SPI_REG_BASE=0x60000200;
+    static constexpr uint32_t SPI_CMD_REG=SPI_REG_BASE+0x00;
+    static constexpr uint32_t SPI_USR_REG=SPI_REG_BASE+0x1C;
+    static constexpr uint32_t SPI_USR1_REG=SPI_REG_BASE+0x20;
+    static constexpr uint32_t SPI_USR2_REG=SPI_REG_BASE+0x24;
+    static constexpr uint32_t SPI_W0_REG=SPI_REG_BASE+0x40;
+    static constexpr uint32_t SPI_USR_COMMAND=1u<<31;
+    static constexpr uint32_t SPI_USR_MISO=1u<<28;
+    static constexpr uint32_t SPI_CMD_USR=1u<<18;
+    static constexpr uint8_t SPIFLASH_RDID=0x9F;
+    // SPI_CMD reads before a flash command counts as stuck.
+    static constexpr uint8_t SPI_BUSY_POLLS=10;
+    
+    static constexpr uint32_t MAX_REPLY=64;
+
+    // Safe rate, the last one tried.
+    static constexpr uint32_t ESP_ROM_BAUD=115200;
+    // The ROM has no CHANGE_BAUDRATE, but it takes the rate of the first SYNC
+    // after a reset. So the connect goes straight to the top of this ladder,
+    // and each rung that doesn't sync drops to the next one down. 1500000 is
+    // 48MHz/32 so the LPC11U68 USART divider hits it exactly.
+    static constexpr uint32_t BAUD_LADDER[]={460800, 921600, 1500000};
+    static constexpr uint8_t BAUD_LADDER_SIZE=sizeof(BAUD_LADDER)/sizeof(BAUD_LADDER[0]);
+    // A resync waits for the line to stay quiet this long, up to
+    // RESYNC_ROUNDS times.
+    static constexpr uint32_t RESYNC_QUIET_MS=20;
+    static constexpr uint8_t RESYNC_ROUNDS=50;
+    
+    // Timeout policy, in ms. Commands wait DEFAULT_TIMEOUT unless their work
+    // grows with the data: erases by the sectors and blocks they cover, data
+    // blocks by the time on the wire at the current rate plus the write.
+    static constexpr uint32_t DEFAULT_TIMEOUT=3000;
+    static constexpr uint32_t SYNC_TIMEOUT=100;
+    static constexpr uint32_t DATA_TIMEOUT_BASE=250;
+    static constexpr uint32_t WRITE_MS_PER_KB=12;
+    // After a reset the ROM is probed with short SYNCs until it answers or
+    // the boot deadline passes; then the ESP is reset again, a few times at
+    // the safe rate and once on a rung above it. The reset pulse is a hold
+    // time for CH_PD, not a wait for the ROM.
+    static constexpr uint32_t SYNC_PROBE_TIMEOUT=25;
+    static constexpr uint32_t BOOT_DEADLINE_MS=600;
+    static constexpr uint8_t CONNECT_ATTEMPTS=3;
+    static constexpr uint32_t RESET_PULSE_MS=100;
+    // A reply polled for after its timeout still gets this long to arrive.
+    static constexpr uint32_t REPLY_GRACE_MS=10;
+
+    enum eConnect: uint8_t
+    {
+        CONNECT_PENDING,
+        CONNECT_DONE,
+        CONNECT_FAILED,
+    };
 
-    ESPLoader(uint32_t _baud);
+    ESPLoader(uint32_t _baud=ESP_ROM_BAUD);
+    ~ESPLoader();
     
     void enterBootLoader(void);
     
-    bool sync(void);
+    bool connect(void);
+    // connect() one probe at a time: connect_start() resets the ESP, then
+    // each connect_poll() sends at most one SYNC, so the caller keeps
+    // running between them.
+    void connect_start(void);
+    eConnect connect_poll(void);
+    bool sync(const uint32_t timeout=SYNC_TIMEOUT);
+    // Step down the ladder after a failed connect or link errors. The next
+    // connect_start() uses the lower rate. Returns false at the safe rate.
+    bool drop_baud(void);
+    uint32_t baud(void) const { return m_baud; }
     bool flash_begin(const uint32_t size, const uint32_t flash_offset=0x00000);
     bool flash_block(const void* data, const uint32_t num_seq, const uint32_t size=FLASH_WRITE_SIZE);
     bool flash_end(const bool reboot=true);
+    
+    // Split FLASH_BEGIN. The ROM erases before it replies,
+    // which takes seconds for a big image, so the caller can poll
+    // reply_ready() or reply_overdue() and only then collect the reply.
+    void flash_begin_send(const uint32_t size, const uint32_t flash_offset=0x00000);
+    bool flash_begin_wait(void);
+    
+    // Split FLASH_DATA: send a block, do other work while the
+    // ESP writes it, then collect the reply. The reply fits in the UART RX
+    // FIFO, so nothing is lost while the caller is busy.
+    void flash_block_send(const void* data, const uint32_t num_seq, const uint32_t size);
+    bool flash_block_wait(void);
+    bool reply_ready(void) { return SLIP::rxPending(); }
+    // The timeout of the command in flight has passed since it was sent.
+    bool reply_overdue(void) const { return Pokitto::Core::getTime()-m_pendingStart>=m_pendingTimeout; }
+    // Let the line go quiet and drop what came in, so that a resent command
+    // starts on a clean frame.
+    void resync(void);
+    // resync() a quiet period at a time: resync_poll() returns true once the
+    // line is quiet or the rounds are used up.
+    void resync_start(void);
+    bool resync_poll(void);
+    
+    bool read_reg(const uint32_t address, uint32_t &value, const uint32_t timeout=DEFAULT_TIMEOUT);
+    bool write_reg(const uint32_t address, const uint32_t value, const uint32_t mask=0xFFFFFFFF, const uint32_t delay_us=0);
+    
+    // Read the JEDEC ID of the flash chip and tell the loader its real size.
+    // Returns the size in bytes, or 0 if the chip didn't answer.
+    uint32_t detect_flash(void);
+    // detect_flash() one command at a time: each detect_poll() sends a
+    // command or collects its reply, and returns true once the detect is
+    // over. flash_size() then holds the result.
+    void detect_start(void);
+    bool detect_poll(void);
+    bool spi_set_params(const uint32_t size);
+    uint32_t flash_size(void) const { return m_flashSize; }
+    // ms from the last reset to the ROM answering SYNC.
+    uint32_t ready_ms(void) const { return m_readyMs; }
 
 private:
     Serial m_uart;
     DigitalOut esp_pinEnable;
     DigitalOut esp_pinReset;
     DigitalOut esp_pinProg;
+    uint32_t m_connectBaud;
+    uint32_t m_baud;
+    uint8_t m_baudCeiling;// Number of ladder rungs connect_start() may use.
+    uint8_t m_pendingCommand;
+    uint32_t m_pendingTimeout;
+    uint32_t m_pendingStart;
+    uint8_t m_connectAttempt;
+    bool m_resetting;// CH_PD is held low for the reset pulse.
+    uint32_t m_connectStart;// Start of the reset pulse, then of the boot.
+    uint32_t m_flashSize;
+    uint32_t m_readyMs;
+    // Value field of the last reply, the result of READ_REG.
+    uint32_t m_replyValue;
+    uint8_t m_resyncRound;
+    uint32_t m_resyncStart;
     
-    void m_flushRX(void);
-    uint32_t m_getEraseSize(const uint32_t offset, const uint32_t size);
-    uint32_t m_checksum(const uint8_t *data, const uint32_t size);
+    // The detect runs the flash chip's RDID through the SPI0 user command
+    // registers, as esptool does, and puts the registers back afterwards.
+    enum eDetectStep: uint8_t
+    {
+        DETECT_ATTACH,  // Empty FLASH_BEGIN.
+        DETECT_SAVE_USR,
+        DETECT_SAVE_USR2,
+        DETECT_SET_USR1,
+        DETECT_SET_USR,
+        DETECT_SET_USR2,
+        DETECT_CLEAR_W0,
+        DETECT_RUN,
+        DETECT_BUSY,    // Read SPI_CMD until the chip is done.
+        DETECT_READ_ID,
+        DETECT_RESTORE_USR,
+        DETECT_RESTORE_USR2,
+        DETECT_SET_PARAMS,
+        DETECT_OVER,
+    };
+    eDetectStep m_detectStep;
+    bool m_detectSent;
+    uint8_t m_detectPolls;
+    uint32_t m_oldUsr;
+    uint32_t m_oldUsr2;
+    uint32_t m_detectSize;// From the JEDEC ID, 0 until it is read.
+    
+    bool m_command(const uint8_t command, const void *data, const uint16_t size, const uint32_t timeout=DEFAULT_TIMEOUT);
+    void m_send(const uint8_t command, const void *data, const uint16_t size, const uint32_t timeout=DEFAULT_TIMEOUT);
+    uint32_t m_pendingLeft(void) const;
+    bool m_response(const uint8_t command, const uint32_t timeout=DEFAULT_TIMEOUT);
+    bool m_flashData(const uint8_t command, const void* data, const uint32_t num_seq, const uint32_t size);
+    void m_sendData(const uint8_t command, const void* data, const uint32_t num_seq, const uint32_t size);
+    uint32_t m_dataTimeout(const uint32_t size);
+    void m_resetStart(void);
+    void m_setBaud(const uint32_t baud);
+    uint32_t m_eraseTimeout(const uint32_t offset, const uint32_t size);
+    void m_readRegSend(const uint32_t address);
+    void m_writeRegSend(const uint32_t address, const uint32_t value);
+    void m_detectSend(void);
+    void m_detectNext(const bool ok);
 };
 
 
-ESPLoader::ESPLoader(uint32_t _baud): m_uart(USBTX, USBRX),esp_pinEnable(P0_21), esp_pinReset(P0_20), esp_pinProg(P1_1)
+ESPLoader::ESPLoader(uint32_t _baud): m_uart(USBTX, USBRX),esp_pinEnable(P0_21), esp_pinReset(P0_20), esp_pinProg(P1_1), m_connectBaud(_baud), m_baudCeiling(BAUD_LADDER_SIZE), m_pendingCommand(0), m_pendingTimeout(DEFAULT_TIMEOUT), m_pendingStart(0), m_connectAttempt(0), m_resetting(false), m_connectStart(0), m_flashSize(0), m_readyMs(0), m_replyValue(0), m_resyncRound(0), m_resyncStart(0), m_detectStep(DETECT_OVER), m_detectSent(false), m_detectPolls(0), m_oldUsr(0), m_oldUsr2(0), m_detectSize(0)
 {
-    m_uart.baud(_baud);//74800
+    m_setBaud(_baud);//74800
     SLIP::setUART(&m_uart);
 }
 
+ESPLoader::~ESPLoader()
+{
+    SLIP::setUART(nullptr);
+}
+
 void ESPLoader::enterBootLoader(void)
 {
     esp_pinEnable = 0;
 	esp_pinProg = 0;
 	esp_pinReset = 1;
-	wait_ms(100);
+	wait_ms(RESET_PULSE_MS);
 	esp_pinEnable = 1;
 }
 
-bool ESPLoader::sync(void)
+// Reset the ESP into the ROM bootloader and sync at the highest rate that
+// works.
+bool ESPLoader::connect(void)
+{
+    for(;;)
+    {
+        connect_start();
+        eConnect result;
+        while((result=connect_poll())==CONNECT_PENDING);
+        if(result==CONNECT_DONE)
+            return true;
+        if(!drop_baud())
+            return false;
+    }
+}
+
+void ESPLoader::connect_start(void)
 {
-    m_flushRX();
+    m_setBaud(m_baudCeiling ? BAUD_LADDER[m_baudCeiling-1] : m_connectBaud);
+    m_connectAttempt=0;
+    m_resetStart();
+}
+
+// Release the reset once the pulse is over, then probe until the ROM answers
+// or the boot deadline passes, and reset again for the next attempt.
+ESPLoader::eConnect ESPLoader::connect_poll(void)
+{
+    uint32_t elapsed=Pokitto::Core::getTime()-m_connectStart;
+    if(m_resetting)
+    {
+        if(elapsed<RESET_PULSE_MS)
+            return CONNECT_PENDING;
+        esp_pinEnable = 1;
+        m_resetting=false;
+        m_connectStart=Pokitto::Core::getTime();
+        return CONNECT_PENDING;
+    }
+    
+    if(sync(SYNC_PROBE_TIMEOUT))
+    {
+        m_readyMs=Pokitto::Core::getTime()-m_connectStart;
+        return CONNECT_DONE;
+    }
+    if(elapsed<BOOT_DEADLINE_MS)
+        return CONNECT_PENDING;
+    if(++m_connectAttempt>=(m_baud==m_connectBaud ? CONNECT_ATTEMPTS : 1))
+        return CONNECT_FAILED;
+    m_resetStart();
+    return CONNECT_PENDING;
+}
+
+bool ESPLoader::sync(const uint32_t timeout)
+{
+    SLIP::flushRX();
     sSlipHeader syncHeader;
     std::memset(&syncHeader, 0, sizeof(sSlipHeader));
     syncHeader.Command=static_cast<uint8_t>(eCommands::SYNC);
@@ -191,69 +726,226 @@ bool ESPLoader::sync(void)
     data[2]=0x12;
     data[3]=0x20;
     
-    sSlipHeader responseHeader;
-    uint8_t responseData[4];
-    
-    for(int i=0;i<3;i++)
-        SLIP::sendPacket(syncHeader, data);
+    SLIP::sendPacket(syncHeader, data);
+    if(!m_response(eCommands::SYNC, timeout))
+        return false;
     
+    // The ROM answers one SYNC several times. Take the rest now so they
+    // aren't mistaken for the reply to the next command.
+    while(m_response(eCommands::SYNC, timeout));
+    return true;
+}
 
-    if(SLIP::recvPacket(responseHeader, responseData, 4))
-    {
-        if(responseHeader.Command==static_cast<uint8_t>(eCommands::SYNC) && responseHeader.Direction==1)
-        {
-            if(responseData[0]==0)
-                return true;
-        }
-    }
-
-    return false;
+// Cap the ladder below the current rate.
+bool ESPLoader::drop_baud(void)
+{
+    if(m_baud<=m_connectBaud)
+        return false;
+    while(m_baudCeiling>0 && BAUD_LADDER[m_baudCeiling-1]>=m_baud)
+        m_baudCeiling--;
+    return true;
 }
 
 bool ESPLoader::flash_begin(const uint32_t size, const uint32_t flash_offset)
 {
-    uint32_t erase_size = m_getEraseSize(flash_offset, size);
-    uint32_t num_data_packets = (size+FLASH_WRITE_SIZE-1)/FLASH_WRITE_SIZE;
+    flash_begin_send(size, flash_offset);
+    return flash_begin_wait();
+}
+
+bool ESPLoader::flash_block(const void* data, const uint32_t num_seq, const uint32_t size)
+{
+    return m_flashData(eCommands::FLASH_DATA, data, num_seq, size);
+}
+
+bool ESPLoader::flash_end(const bool reboot)
+{
+    uint32_t reboot32=reboot?0:1;
+    return m_command(eCommands::FLASH_END, &reboot32, 4);
+}
+
+void ESPLoader::flash_begin_send(const uint32_t size, const uint32_t flash_offset)
+{
+    uint32_t erase_size = FlashLayout::eraseSize(flash_offset, size);
     uint32_t packet_size=FLASH_WRITE_SIZE; 
+    uint32_t num_data_packets = (size+packet_size-1)/packet_size;
 
-    sSlipHeader fbHeader;
-    std::memset(&fbHeader, 0, sizeof(sSlipHeader));
-    fbHeader.Command=static_cast<uint8_t>(eCommands::FLASH_BEGIN);
-    fbHeader.Size=16;
     uint8_t data[16];
     std::memcpy(data, &erase_size, sizeof(uint32_t));
     std::memcpy(data+sizeof(uint32_t), &num_data_packets, sizeof(uint32_t));
     std::memcpy(data+sizeof(uint32_t)*2, &packet_size, sizeof(uint32_t));
     std::memcpy(data+sizeof(uint32_t)*3, &flash_offset, sizeof(uint32_t));
     
-    sSlipHeader responseHeader;
-    uint8_t responseData[4];
-    m_flushRX();
-    SLIP::sendPacket(fbHeader, data);
+    // The ROM erases before it replies.
+    m_send(eCommands::FLASH_BEGIN, data, 16, m_eraseTimeout(flash_offset, size));
+}
+
+bool ESPLoader::flash_begin_wait(void)
+{
+    return m_response(m_pendingCommand, m_pendingLeft());
+}
+
+void ESPLoader::flash_block_send(const void* data, const uint32_t num_seq, const uint32_t size)
+{
+    m_pendingCommand=eCommands::FLASH_DATA;
+    m_sendData(m_pendingCommand, data, num_seq, size);
+    m_pendingTimeout=m_dataTimeout(size);
+    m_pendingStart=Pokitto::Core::getTime();
+}
+
+bool ESPLoader::flash_block_wait(void)
+{
+    return m_response(m_pendingCommand, m_pendingLeft());
+}
+
+void ESPLoader::resync(void)
+{
+    resync_start();
+    while(!resync_poll());
+}
+
+void ESPLoader::resync_start(void)
+{
+    SLIP::flush();
+    SLIP::flushRX();
+    m_resyncRound=0;
+    m_resyncStart=Pokitto::Core::getTime();
+}
+
+// Anything that came in during the quiet period starts another one.
+bool ESPLoader::resync_poll(void)
+{
+    if(Pokitto::Core::getTime()-m_resyncStart<RESYNC_QUIET_MS)
+        return false;
+    if(!SLIP::flushRX() || ++m_resyncRound>=RESYNC_ROUNDS)
+        return true;
+    m_resyncStart=Pokitto::Core::getTime();
+    return false;
+}
+
+bool ESPLoader::read_reg(const uint32_t address, uint32_t &value, const uint32_t timeout)
+{
+    if(!m_command(eCommands::READ_REG, &address, 4, timeout))
+        return false;
+    value=m_replyValue;
+    return true;
+}
+
+bool ESPLoader::write_reg(const uint32_t address, const uint32_t value, const uint32_t mask, const uint32_t delay_us)
+{
+    uint32_t data[4]={address, value, mask, delay_us};
+    return m_command(eCommands::WRITE_REG, data, 16);
+}
+
+uint32_t ESPLoader::detect_flash(void)
+{
+    detect_start();
+    while(!detect_poll());
+    return m_flashSize;
+}
+
+void ESPLoader::detect_start(void)
+{
+    m_flashSize=0;
+    m_detectSize=0;
+    m_detectPolls=0;
+    m_detectSent=false;
+    m_detectStep=DETECT_ATTACH;
+}
+
+bool ESPLoader::detect_poll(void)
+{
+    if(m_detectStep==DETECT_OVER)
+        return true;
+    if(!m_detectSent)
+    {
+        m_detectSend();
+        m_detectSent=true;
+        return false;
+    }
+    if(!reply_ready() && !reply_overdue())
+        return false;
+    m_detectSent=false;
+    m_detectNext(m_response(m_pendingCommand, m_pendingLeft()));
+    return m_detectStep==DETECT_OVER;
+}
+
+bool ESPLoader::spi_set_params(const uint32_t size)
+{
+    uint32_t data[6]={0, size, FLASH_BLOCK_SIZE, FLASH_SECTOR_SIZE, FLASH_PAGE_SIZE, 0xFFFF};
+    return m_command(eCommands::SPI_SET_PARAMS, data, sizeof(data));
+}
+
+
+bool ESPLoader::m_command(const uint8_t command, const void *data, const uint16_t size, const uint32_t timeout)
+{
+    m_send(command, data, size, timeout);
+    return m_response(command, timeout);
+}
+
+// Send a command and note it as the one in flight. Its timeout runs from now.
+void ESPLoader::m_send(const uint8_t command, const void *data, const uint16_t size, const uint32_t timeout)
+{
+    SLIP::flushRX();
+    sSlipHeader header;
+    std::memset(&header, 0, sizeof(sSlipHeader));
+    header.Command=command;
+    header.Size=size;
     
-    if(SLIP::recvPacket(responseHeader, responseData, 4))
+    SLIP::sendPacket(header, data);
+    
+    m_pendingCommand=command;
+    m_pendingTimeout=timeout;
+    m_pendingStart=Pokitto::Core::getTime();
+}
+
+uint32_t ESPLoader::m_pendingLeft(void) const
+{
+    uint32_t elapsed=Pokitto::Core::getTime()-m_pendingStart;
+    if(elapsed+REPLY_GRACE_MS>=m_pendingTimeout)
+        return REPLY_GRACE_MS;
+    return m_pendingTimeout-elapsed;
+}
+
+// The reply body ends with two status bytes, the first one 0 on success.
+bool ESPLoader::m_response(const uint8_t command, const uint32_t timeout)
+{
+    sSlipHeader responseHeader;
+    uint8_t responseData[MAX_REPLY+2];
+
+    if(SLIP::recvPacket(responseHeader, responseData, sizeof(responseData), timeout))
     {
-        if(responseHeader.Command==static_cast<uint8_t>(eCommands::FLASH_BEGIN) && responseHeader.Direction==1)
+        if(responseHeader.Command==command && responseHeader.Direction==1 && responseHeader.Size>=2)
         {
-            if(responseData[0]==0)
+            if(responseData[responseHeader.Size-2]==0)
+            {
+                m_replyValue=responseHeader.Value;
                 return true;
+            }
         }
     }
 
     return false;
 }
 
-bool ESPLoader::flash_block(const void* data, const uint32_t num_seq, const uint32_t size)
+bool ESPLoader::m_flashData(const uint8_t command, const void* data, const uint32_t num_seq, const uint32_t size)
 {
-    m_flushRX();
+    m_sendData(command, data, num_seq, size);
+    return m_response(command, m_dataTimeout(size));
+}
+
+void ESPLoader::m_sendData(const uint8_t command, const void* data, const uint32_t num_seq, const uint32_t size)
+{
+    SLIP::flushRX();
     sSlipHeader fdHeader;
     std::memset(&fdHeader, 0, sizeof(sSlipHeader));
-    fdHeader.Command=static_cast<uint8_t>(eCommands::FLASH_DATA);
+    fdHeader.Command=command;
     fdHeader.Size=size+sizeof(uint32_t)*4;
-    fdHeader.Value=m_checksum(reinterpret_cast<const uint8_t*>(data), size);
+    SLIP::sFrameScan scan;
+    SLIP::scanFrameBuf(data, size, scan);
+    fdHeader.Value=ESP_CHECKSUM_MAGIC^scan.Checksum;
     
     uint8_t hData[sizeof(uint32_t)*4];
-    
+    std::memset(hData, 0, sizeof(hData));
     std::memcpy(hData, &size, sizeof(uint32_t));
     std::memcpy(hData+sizeof(uint32_t), &num_seq, sizeof(uint32_t));
 
@@ -261,83 +953,136 @@ bool ESPLoader::flash_block(const void* data, const uint32_t num_seq, const uint
     SLIP::sendFrameDelimiter();
     SLIP::sendFrameBuf(&fdHeader, sizeof(sSlipHeader));
     SLIP::sendFrameBuf(hData, sizeof(uint32_t)*4);
-    SLIP::sendFrameBuf(data, size);
+    SLIP::sendScannedBuf(data, size, scan);
     SLIP::sendFrameDelimiter();
-    
-    
-    sSlipHeader responseHeader;
-    uint8_t responseData[4];
-
-    if(SLIP::recvPacket(responseHeader, responseData, 4))
-    {
-        if(responseHeader.Command==static_cast<uint8_t>(eCommands::FLASH_DATA) && responseHeader.Direction==1)
-        {
-            if(responseData[0]==0)
-                return true;
-        }
-    }
-
-    return false;
 }
 
-bool ESPLoader::flash_end(const bool reboot)
+// A data block: the frame on the wire at the current rate, every byte
+// escaped at worst, then writing it.
+uint32_t ESPLoader::m_dataTimeout(const uint32_t size)
 {
-    uint32_t reboot32=reboot?0:1;
-    
-    m_flushRX();
-    sSlipHeader feHeader;
-    std::memset(&feHeader, 0, sizeof(sSlipHeader));
-    feHeader.Command=static_cast<uint8_t>(eCommands::FLASH_END);
-    feHeader.Size=4;
-    uint8_t data[4];
-    
-    std::memcpy(data, &reboot32, sizeof(uint32_t));
+    uint32_t wire=(uint64_t)(2*size+32)*10*1000/m_baud+1;
+    uint32_t write=(size+1023)/1024*WRITE_MS_PER_KB;
+    return DATA_TIMEOUT_BASE+wire+write;
+}
 
-    
-    sSlipHeader responseHeader;
-    uint8_t responseData[4];
-    
-    SLIP::sendPacket(feHeader, data);
-    
+// enterBootLoader() without the wait: connect_poll() ends the pulse.
+void ESPLoader::m_resetStart(void)
+{
+    esp_pinEnable = 0;
+    esp_pinProg = 0;
+    esp_pinReset = 1;
+    m_resetting=true;
+    m_connectStart=Pokitto::Core::getTime();
+}
 
-    if(SLIP::recvPacket(responseHeader, responseData, 4))
-    {
-        if(responseHeader.Command==static_cast<uint8_t>(eCommands::FLASH_END) && responseHeader.Direction==1)
-        {
-            if(responseData[0]==0)
-                return true;
-        }
-    }
+void ESPLoader::m_setBaud(const uint32_t baud)
+{
+    // Don't change the rate under bytes still in the ring.
+    SLIP::flush();
+    m_baud=baud;
+    m_uart.baud(baud);
+}
 
-    return false;
+uint32_t ESPLoader::m_eraseTimeout(const uint32_t offset, const uint32_t size)
+{
+    FlashLayout::sErasePlan plan=FlashLayout::erasePlan(offset, size);
+    uint32_t timeout=plan.sectors*ERASE_SECTOR_MS+plan.blocks*ERASE_BLOCK_MS;
+    return timeout<DEFAULT_TIMEOUT ? DEFAULT_TIMEOUT : timeout;
 }
 
+void ESPLoader::m_readRegSend(const uint32_t address)
+{
+    m_send(eCommands::READ_REG, &address, 4);
+}
 
-void ESPLoader::m_flushRX(void)
+void ESPLoader::m_writeRegSend(const uint32_t address, const uint32_t value)
 {
-    while(m_uart.readable())
-        m_uart.getc();
+    uint32_t data[4]={address, value, 0xFFFFFFFF, 0};
+    m_send(eCommands::WRITE_REG, data, 16);
 }
 
-uint32_t ESPLoader::m_getEraseSize(const uint32_t offset, const uint32_t size)
+void ESPLoader::m_detectSend(void)
 {
-    auto sectors_per_block=16;
-    auto sector_size = FLASH_SECTOR_SIZE;
-    auto num_sectors = (size+ sector_size-1)/sector_size;
-    auto start_sector = offset/sector_size;
-    
-    auto head_sectors = sectors_per_block - (start_sector%sectors_per_block);
-    if(num_sectors <(2*head_sectors))
-        return (num_sectors+1)/(2*sector_size);
-    else
-        return (num_sectors-head_sectors)*sector_size;
-    
+    switch(m_detectStep)
+    {
+        // The ESP8266 ROM only attaches the SPI flash for a flash command. An
+        // empty begin does that without erasing anything, as esptool does.
+        case DETECT_ATTACH:     flash_begin_send(0, 0); break;
+        case DETECT_SAVE_USR:   m_readRegSend(SPI_USR_REG); break;
+        case DETECT_SAVE_USR2:  m_readRegSend(SPI_USR2_REG); break;
+        // 24 MISO bits, their length at bit 8 of USR1; the 8 bit command,
+        // its length at bit 28 of USR2.
+        case DETECT_SET_USR1:   m_writeRegSend(SPI_USR1_REG, (24-1)<<8); break;
+        case DETECT_SET_USR:    m_writeRegSend(SPI_USR_REG, SPI_USR_COMMAND | SPI_USR_MISO); break;
+        case DETECT_SET_USR2:   m_writeRegSend(SPI_USR2_REG, (7u<<28) | SPIFLASH_RDID); break;
+        case DETECT_CLEAR_W0:   m_writeRegSend(SPI_W0_REG, 0); break;
+        case DETECT_RUN:        m_writeRegSend(SPI_CMD_REG, SPI_CMD_USR); break;
+        case DETECT_BUSY:       m_readRegSend(SPI_CMD_REG); break;
+        case DETECT_READ_ID:    m_readRegSend(SPI_W0_REG); break;
+        case DETECT_RESTORE_USR: m_writeRegSend(SPI_USR_REG, m_oldUsr); break;
+        case DETECT_RESTORE_USR2: m_writeRegSend(SPI_USR2_REG, m_oldUsr2); break;
+        case DETECT_SET_PARAMS:
+        {
+            uint32_t data[6]={0, m_detectSize, FLASH_BLOCK_SIZE, FLASH_SECTOR_SIZE, FLASH_PAGE_SIZE, 0xFFFF};
+            m_send(eCommands::SPI_SET_PARAMS, data, sizeof(data));
+            break;
+        }
+        default: break;
+    }
 }
 
-uint32_t ESPLoader::m_checksum(const uint8_t *data, const uint32_t size)
+// Once the registers are changed, a failure still puts them back.
+void ESPLoader::m_detectNext(const bool ok)
 {
-    uint32_t checksum=ESP_CHECKSUM_MAGIC;
-    for(int i=0;i<size;i++)
-        checksum ^= data[i];
-    return checksum;
+    switch(m_detectStep)
+    {
+        case DETECT_ATTACH:
+            m_detectStep=ok ? DETECT_SAVE_USR : DETECT_OVER;
+            break;
+        case DETECT_SAVE_USR:
+            m_oldUsr=m_replyValue;
+            m_detectStep=ok ? DETECT_SAVE_USR2 : DETECT_OVER;
+            break;
+        case DETECT_SAVE_USR2:
+            m_oldUsr2=m_replyValue;
+            m_detectStep=ok ? DETECT_SET_USR1 : DETECT_OVER;
+            break;
+        case DETECT_SET_USR1:
+        case DETECT_SET_USR:
+        case DETECT_SET_USR2:
+        case DETECT_CLEAR_W0:
+        case DETECT_RUN:
+            m_detectStep=ok ? static_cast<eDetectStep>(m_detectStep+1) : DETECT_RESTORE_USR;
+            break;
+        case DETECT_BUSY:
+            if(ok && !(m_replyValue & SPI_CMD_USR))
+                m_detectStep=DETECT_READ_ID;
+            else if(!ok || ++m_detectPolls>=SPI_BUSY_POLLS)
+                m_detectStep=DETECT_RESTORE_USR;
+            break;
+        case DETECT_READ_ID:
+        {
+            // Manufacturer, memory type, then log2 of the size in bytes.
+            uint8_t sizeId=(m_replyValue>>16)&0xFF;
+            if(ok && sizeId>=0x12 && sizeId<=0x18)
+                m_detectSize=1u<<sizeId;
+            m_detectStep=DETECT_RESTORE_USR;
+            break;
+        }
+        case DETECT_RESTORE_USR:
+            m_detectStep=DETECT_RESTORE_USR2;
+            break;
+        case DETECT_RESTORE_USR2:
+            m_detectStep=m_detectSize ? DETECT_SET_PARAMS : DETECT_OVER;
+            break;
+        case DETECT_SET_PARAMS:
+            if(ok)
+                m_flashSize=m_detectSize;
+            m_detectStep=DETECT_OVER;
+            break;
+        default:
+            m_detectStep=DETECT_OVER;
+            break;
+    }
 }
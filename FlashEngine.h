@@ -0,0 +1,728 @@
+#pragma once
+#include <mbed.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "FATFileSystem.h"
+#include "ESPLoader.h"
+#include "Deflate.h"
+#include "MD5.h"
+
+struct sFlashImage
+{
+    std::string path;
+    uint32_t offset=0;
+    // Filled in by FlashEngine when it sizes the file.
+    uint32_t fsize=0;
+    uint32_t imageSize=0;  // Bytes it takes in flash. Differs from fsize for a pre-deflated file.
+    bool preDeflated=false;
+};
+
+struct sJournal
+{
+    uint32_t magic;
+    uint32_t offset;
+    uint32_t fsize;
+    uint32_t done;  // Bytes from the start of the image acknowledged by the ESP.
+    uint8_t md5[16];// Of those bytes, so a different file with the same name and size isn't resumed.
+    char path[64];
+};
+
+// Flashes images from the SD card in one bootloader session, one step at a
+// time: a connect, an erase, a block. tick() runs steps for a time
+// budget and returns, so the caller keeps drawing frames and reading buttons
+// in between. Nothing is drawn here; the caller shows status() and
+// progress() as it likes.
+class FlashEngine
+{
+public:
+    // A resume hashes the part already written in pieces of this size, one per step.
+    static constexpr uint32_t RESUME_CHUNK=0x4000;
+    // A pre-deflated image is sized by inflating this much of it per step.
+    static constexpr uint32_t SIZE_CHUNK=0x4000;
+    static constexpr uint32_t JOURNAL_INTERVAL=0x10000;
+    static constexpr uint32_t JOURNAL_MAGIC=0x4A505345;// "ESPJ"
+    static constexpr uint32_t WRITE_BLOCK_ATTEMPTS=3;
+    // Reconnects at the base rate, once there is no lower rate to drop to.
+    static constexpr uint32_t BASE_RATE_RETRIES=1;
+    // History kept to inflate a pre-deflated image. Deflate it with a window
+    // no bigger than this, e.g. zlib's wbits=12; bigger ones are refused.
+    static constexpr uint32_t INFLATE_WINDOW=0x1000;
+
+    enum ePhase: uint8_t
+    {
+        PHASE_IDLE,
+        PHASE_PREPARE,  // Size one image file per step.
+        PHASE_SIZE,     // Inflate one chunk of a pre-deflated image per step.
+        PHASE_CONNECT,
+        PHASE_SYNC,     // One SYNC probe per step until the ROM answers.
+        PHASE_DETECT,   // One register command per step.
+        PHASE_IMAGE,    // Open the next image and pick how it goes out.
+        PHASE_RESUME,   // Hash one chunk of what the journal says is written per step.
+        PHASE_ERASE,    // Begin a write, which erases its range.
+        PHASE_ERASE_WAIT,
+        PHASE_BLOCKS,   // Send a block and read the next one.
+        PHASE_BLOCK_WAIT,
+        PHASE_BLOCK_RESYNC,// Wait for a quiet line before sending a block again.
+        PHASE_FINISH,
+        PHASE_DONE,
+        PHASE_FAILED,
+    };
+
+    struct sStats
+    {
+        uint32_t blocksSent;
+        uint32_t readsHidden;// SD reads that finished before the ESP replied to the block in flight.
+        uint32_t blockRetries;
+        uint32_t espReadyMs;// ESP ROM boot, from reset to answering SYNC.
+        uint32_t baseRateRetries;
+    };
+
+    // The journal of a ROM write lives next to the images in fs.
+    FlashEngine(FATFileSystem &fs, const std::string &journalName);
+    ~FlashEngine();
+
+    void start(const std::vector<sFlashImage> &images);
+    // Run steps for about budgetMs, at least one. A step that changes the
+    // status ends the tick early, so the status is seen before the next
+    // step, which may be a long one. Returns true while there is more to do.
+    bool tick(const uint32_t budgetMs);
+    // Stop before the next step. A ROM write keeps its journal, so a later
+    // run resumes it.
+    void cancel(void) { m_cancel=true; }
+
+    bool busy(void) const { return m_phase!=PHASE_IDLE && m_phase<PHASE_DONE; }
+    bool succeeded(void) const { return m_phase==PHASE_DONE; }
+    ePhase phase(void) const { return m_phase; }
+    // What is being done, or why it stopped. A value of -1 means there is no
+    // number to show after the message.
+    const char *status(void) const { return m_status; }
+    int32_t statusValue(void) const { return m_statusValue; }
+    const char *statusUnit(void) const { return m_statusUnit; }
+    bool statusError(void) const { return m_statusError; }
+    // Changes with every new status.
+    uint32_t statusSeq(void) const { return m_statusSeq; }
+    // Percent through the journal check or write in progress, -1 outside them.
+    int32_t progress(void) const { return m_progress; }
+    const sStats &stats(void) const { return m_stats; }
+
+private:
+    FATFileSystem &m_fs;
+    std::string m_journalName;
+    std::vector<sFlashImage> m_images;
+    ePhase m_phase;
+    bool m_cancel;
+    sStats m_stats;
+    const char *m_status;
+    int32_t m_statusValue;
+    const char *m_statusUnit;
+    bool m_statusError;
+    uint32_t m_statusSeq;
+    int32_t m_progress;
+
+    ESPLoader *m_loader;
+    size_t m_next;// Image being prepared or flashed.
+    uint8_t *m_buffers[2];
+    uint32_t m_blockSize;
+    uint8_t *m_window;// For pre-deflated images, allocated with the first one.
+
+    // The image being flashed.
+    FileHandle *m_file;
+    // A ROM write hashes what the ESP acknowledges, for the journal. A resume
+    // first hashes the file up to where the journal says and checks it.
+    MD5 m_journalHash;
+    uint8_t m_resumeHash[MD5::DIGEST_SIZE];
+    uint32_t m_resumeAt;
+    uint32_t m_resumeRead;
+
+    // The write in progress: length bytes of the file from start on, which
+    // expand to imageSize in flash.
+    uint32_t m_start;
+    uint32_t m_length;
+    uint32_t m_imageSize;
+    bool m_preDeflated;
+    bool m_journal;
+    Inflater *m_inflater;
+    uint32_t m_left;
+    uint32_t m_count;
+    uint32_t m_nextCount;// Read into the other buffer while the block is in flight.
+    uint32_t m_seq;
+    uint32_t m_attempt;
+
+    void m_step(void);
+    bool m_stepPrepare(void);
+    bool m_stepSize(void);
+    bool m_prepared(void);
+    bool m_stepConnect(void);
+    bool m_stepSync(void);
+    bool m_stepDetect(void);
+    bool m_stepImage(void);
+    bool m_stepResume(void);
+    bool m_stepErase(void);
+    bool m_stepEraseWait(void);
+    bool m_stepBlock(void);
+    bool m_stepBlockWait(void);
+    bool m_stepBlockResync(void);
+    bool m_stepFinish(void);
+
+    void m_sendWhole(void);
+    void m_beginWrite(const uint32_t start, const uint32_t length, const uint32_t imageSize, const bool preDeflated, const bool journal);
+    uint32_t m_readBlock(uint8_t *data);
+    bool m_planImages(const uint32_t flashSize);
+    uint32_t m_readJournal(const sFlashImage &image, uint8_t *md5);
+    void m_writeJournal(const sFlashImage &image, const uint32_t done);
+
+    void m_setStatus(const char *message, const int32_t value=-1, const char *unit="", const bool error=false);
+    bool m_announce(const char *message);
+    bool m_retry(const char *message);
+    bool m_fail(const char *message);
+    void m_closeImage(void);
+    void m_release(void);
+
+};
+
+
+FlashEngine::FlashEngine(FATFileSystem &fs, const std::string &journalName): m_fs(fs), m_journalName(journalName), m_phase(PHASE_IDLE), m_cancel(false),
+    m_status(""), m_statusValue(-1), m_statusUnit(""), m_statusError(false), m_statusSeq(0), m_progress(-1), m_loader(nullptr), m_next(0),
+    m_buffers{nullptr, nullptr}, m_blockSize(0), m_window(nullptr), m_file(nullptr), m_inflater(nullptr)
+{
+    std::memset(&m_stats, 0, sizeof(m_stats));
+}
+
+FlashEngine::~FlashEngine()
+{
+    m_release();
+}
+
+void FlashEngine::start(const std::vector<sFlashImage> &images)
+{
+    m_release();
+    m_images=images;
+    m_cancel=false;
+    m_next=0;
+    m_progress=-1;
+    std::memset(&m_stats, 0, sizeof(m_stats));
+    m_phase=PHASE_PREPARE;
+    if(m_images.empty())
+        m_fail("No image to flash");
+}
+
+bool FlashEngine::tick(const uint32_t budgetMs)
+{
+    uint32_t started=Pokitto::Core::getTime();
+    uint32_t seq=m_statusSeq;
+    while(busy())
+    {
+        if(m_cancel)
+        {
+            m_fail("Flashing cancelled");
+            break;
+        }
+        m_step();
+        if(m_statusSeq!=seq || Pokitto::Core::getTime()-started>=budgetMs)
+            break;
+    }
+    return busy();
+}
+
+void FlashEngine::m_step(void)
+{
+    switch(m_phase)
+    {
+        case PHASE_PREPARE: m_stepPrepare(); break;
+        case PHASE_SIZE:    m_stepSize(); break;
+        case PHASE_CONNECT: m_stepConnect(); break;
+        case PHASE_SYNC:    m_stepSync(); break;
+        case PHASE_DETECT:  m_stepDetect(); break;
+        case PHASE_IMAGE:   m_stepImage(); break;
+        case PHASE_RESUME:  m_stepResume(); break;
+        case PHASE_ERASE:   m_stepErase(); break;
+        case PHASE_ERASE_WAIT: m_stepEraseWait(); break;
+        case PHASE_BLOCKS:  m_stepBlock(); break;
+        case PHASE_BLOCK_WAIT: m_stepBlockWait(); break;
+        case PHASE_BLOCK_RESYNC: m_stepBlockResync(); break;
+        case PHASE_FINISH:  m_stepFinish(); break;
+        default: break;
+    }
+}
+
+// Size the image and find out whether it is a zlib stream.
+bool FlashEngine::m_stepPrepare(void)
+{
+    sFlashImage &image=m_images[m_next];
+    FileHandle *file=m_fs.open(image.path.c_str(), O_RDONLY );
+    if(!file)
+        return m_fail("File open failed");
+
+    // A file that is already a zlib stream is inflated as it is sent, which
+    // needs its window in RAM. Its inflated size is needed for the erase, so
+    // walk the stream once, over the next steps. That needs no window, only
+    // the length is counted.
+    image.fsize=file->flen();
+    uint8_t head[2]={0,0};
+    file->read(head, 2);
+    image.preDeflated=Deflate::isZlibHeader(head);
+    image.imageSize=image.fsize;
+    if(image.preDeflated && Deflate::windowSize(head)>INFLATE_WINDOW)
+    {
+        file->close();
+        return m_fail("Compressed with a window > 4 KB");
+    }
+    if(image.preDeflated)
+    {
+        file->lseek(0, SEEK_SET);
+        m_file=file;
+        m_inflater=new Inflater(m_file);
+        image.imageSize=0;
+        m_progress=0;
+        m_setStatus("Checking compressed image: ");
+        m_phase=PHASE_SIZE;
+        return true;
+    }
+    file->close();
+
+    if(image.imageSize==0)
+        return m_fail("Image is empty");
+    return m_prepared();
+}
+
+bool FlashEngine::m_stepSize(void)
+{
+    sFlashImage &image=m_images[m_next];
+    image.imageSize+=m_inflater->skip(SIZE_CHUNK);
+    if(!m_inflater->done() && !m_inflater->failed())
+    {
+        m_progress=image.fsize ? (100*(uint64_t)m_inflater->consumed())/image.fsize : 100;
+        return true;
+    }
+    bool ok=m_inflater->done() && !m_inflater->failed() && image.imageSize>0;
+    m_closeImage();
+    if(!ok)
+        return m_fail("Compressed image is corrupt");
+    return m_prepared();
+}
+
+// The image at m_next is sized. Go on with the next one, or plan the writes
+// once they all are.
+bool FlashEngine::m_prepared(void)
+{
+    m_phase=PHASE_PREPARE;
+    if(++m_next<m_images.size())
+        return true;
+
+    if(!m_planImages(0))
+        return false;
+    m_next=0;
+    m_phase=PHASE_CONNECT;
+    return true;
+}
+
+bool FlashEngine::m_stepConnect(void)
+{
+    if(m_announce("Connecting to ESP8266 Module"))
+        return true;
+    if(!m_loader)
+        m_loader=new ESPLoader(ESPLoader::ESP_ROM_BAUD);
+    m_loader->connect_start();
+    m_phase=PHASE_SYNC;
+    return true;
+}
+
+bool FlashEngine::m_stepSync(void)
+{
+    ESPLoader::eConnect result=m_loader->connect_poll();
+    if(result==ESPLoader::CONNECT_PENDING)
+        return true;
+    if(result==ESPLoader::CONNECT_FAILED)
+    {
+        // The ROM locks to the rate of the first SYNC, so a lower rate needs
+        // a new reset.
+        if(!m_loader->drop_baud())
+            return m_fail("Can't connect ESP8266 Module");
+        m_loader->connect_start();
+        return true;
+    }
+    m_stats.espReadyMs=m_loader->ready_ms();
+    m_setStatus("Baud rate: ", m_loader->baud());
+    m_loader->detect_start();
+    m_phase=PHASE_DETECT;
+    return true;
+}
+
+// Set the loader up for the real flash chip, and don't start on an image
+// that can't fit. An unknown chip keeps the loader's default.
+bool FlashEngine::m_stepDetect(void)
+{
+    if(!m_loader->detect_poll())
+        return true;
+    uint32_t flashSize=m_loader->flash_size();
+    if(flashSize)
+    {
+        m_setStatus("Flash size: ", flashSize/1024, " KB");
+        if(!m_planImages(flashSize))
+            return false;
+    }
+
+    // Two buffers: block N+1 is read from SD while block N is on the wire
+    // and being written by the ESP.
+    if(!m_blockSize)
+    {
+        m_blockSize=ESPLoader::FLASH_WRITE_SIZE;
+        m_buffers[0]=new uint8_t[m_blockSize];
+        m_buffers[1]=new uint8_t[m_blockSize];
+    }
+    m_phase=PHASE_IMAGE;
+    return true;
+}
+
+// Open the next image, or finish after the last one.
+bool FlashEngine::m_stepImage(void)
+{
+    if(m_next==m_images.size())
+    {
+        m_phase=PHASE_FINISH;
+        return true;
+    }
+
+    sFlashImage &image=m_images[m_next];
+    m_file=m_fs.open(image.path.c_str(), O_RDONLY );
+    if(!m_file)
+        return m_fail("File open failed");
+
+    m_sendWhole();
+    return true;
+}
+
+// The ROM erases before it replies, so the reply is polled for over the
+// next steps.
+bool FlashEngine::m_stepErase(void)
+{
+    const sFlashImage &image=m_images[m_next];
+    m_loader->flash_begin_send(m_imageSize, image.offset+m_start);
+    m_phase=PHASE_ERASE_WAIT;
+    return true;
+}
+
+bool FlashEngine::m_stepEraseWait(void)
+{
+    if(!m_loader->reply_ready() && !m_loader->reply_overdue())
+        return true;
+    if(!m_loader->flash_begin_wait())
+        return m_retry("Flash Erase Failed");
+
+    m_file->lseek(m_start, SEEK_SET);
+    if(m_preDeflated)
+    {
+        if(!m_window)
+            m_window=new uint8_t[INFLATE_WINDOW];
+        m_inflater=new Inflater(m_file);
+        m_inflater->setWindow(m_window, INFLATE_WINDOW);
+    }
+
+    m_left=m_length;
+    m_seq=0;
+    m_count=m_readBlock(m_buffers[0]);
+    m_progress=0;
+    m_setStatus("Flashing Firmware: ");
+    m_phase=PHASE_BLOCKS;
+    return true;
+}
+
+bool FlashEngine::m_stepBlock(void)
+{
+    const sFlashImage &image=m_images[m_next];
+    if(m_count>0)
+    {
+        // Progress follows the SD file position.
+        uint32_t done=m_start+(m_inflater ? m_inflater->consumed() : m_seq*m_blockSize);
+        m_progress=image.fsize ? (100*(uint64_t)done)/image.fsize : 100;
+
+        m_loader->flash_block_send(m_buffers[m_seq&1], m_seq, m_count);
+        m_nextCount=m_readBlock(m_buffers[(m_seq+1)&1]);
+        if(!m_loader->reply_ready())
+            m_stats.readsHidden++;
+        m_stats.blocksSent++;
+        m_attempt=1;
+        m_phase=PHASE_BLOCK_WAIT;
+        return true;
+    }
+
+    // The SD card stopped short of the write. That isn't the link's fault.
+    if(m_inflater ? !m_inflater->done() : m_left>0)
+        return m_fail("File read failed");
+    m_closeImage();
+    m_next++;
+    m_phase=PHASE_IMAGE;
+    return true;
+}
+
+// A block that isn't acknowledged is sent again once the line is quiet. Its
+// buffer is still intact, the read went to the other one.
+bool FlashEngine::m_stepBlockWait(void)
+{
+    if(!m_loader->reply_ready() && !m_loader->reply_overdue())
+        return true;
+    if(!m_loader->flash_block_wait())
+    {
+        if(m_attempt>=WRITE_BLOCK_ATTEMPTS)
+            return m_retry("Sending data to ESP8266 Module Failed");
+        m_stats.blockRetries++;
+        m_loader->resync_start();
+        m_phase=PHASE_BLOCK_RESYNC;
+        return true;
+    }
+
+    // Raw files map to flash one to one, so record the progress now and
+    // then for a retry to resume from. Writes start on a journal point and
+    // blocks divide JOURNAL_INTERVAL, so each point is hit exactly.
+    if(m_journal)
+    {
+        const sFlashImage &image=m_images[m_next];
+        m_journalHash.update(m_buffers[m_seq&1], m_count);
+        uint32_t after=m_start+m_seq*m_blockSize+m_count;
+        if(after%JOURNAL_INTERVAL==0 && after<image.fsize)
+            m_writeJournal(image, after);
+    }
+    m_count=m_nextCount;
+    m_seq++;
+    m_phase=PHASE_BLOCKS;
+    return true;
+}
+
+bool FlashEngine::m_stepBlockResync(void)
+{
+    if(!m_loader->resync_poll())
+        return true;
+    m_loader->flash_block_send(m_buffers[m_seq&1], m_seq, m_count);
+    m_attempt++;
+    m_phase=PHASE_BLOCK_WAIT;
+    return true;
+}
+
+bool FlashEngine::m_stepFinish(void)
+{
+    if(!m_loader->flash_end(true))
+        return m_fail("Finishing flash failed, file kept");
+
+    // Every block and the end were acknowledged, so the files are done with.
+    for(auto &image : m_images)
+        m_fs.remove(image.path.c_str());
+    m_fs.remove(m_journalName.c_str());
+
+    m_setStatus("Firmware flashed Successfully");
+    m_release();
+    m_phase=PHASE_DONE;
+    return true;
+}
+
+// The whole image in one write. A ROM write picks up where the journal says a
+// previous attempt got to, once the file is known to be the same up to there.
+void FlashEngine::m_sendWhole(void)
+{
+    const sFlashImage &image=m_images[m_next];
+    if(!image.preDeflated)
+    {
+        m_journalHash.reset();
+        m_resumeAt=m_readJournal(image, m_resumeHash);
+        if(m_resumeAt)
+        {
+            m_resumeRead=0;
+            m_file->lseek(0, SEEK_SET);
+            m_progress=0;
+            m_setStatus("Checking journal: ");
+            m_phase=PHASE_RESUME;
+        }
+        else
+            m_beginWrite(0, image.fsize, image.fsize, false, true);
+    }
+    else
+    {
+        m_beginWrite(0, image.fsize, image.imageSize, image.preDeflated, false);
+    }
+}
+
+bool FlashEngine::m_stepResume(void)
+{
+    const sFlashImage &image=m_images[m_next];
+    uint32_t end=(m_resumeAt-m_resumeRead<RESUME_CHUNK) ? m_resumeAt : m_resumeRead+RESUME_CHUNK;
+    while(m_resumeRead<end)
+    {
+        int count=m_file->read(m_buffers[0], (end-m_resumeRead<m_blockSize) ? end-m_resumeRead : m_blockSize);
+        if(count<=0)
+            return m_fail("File read failed");
+        m_journalHash.update(m_buffers[0], count);
+        m_resumeRead+=count;
+    }
+    m_progress=(100*(uint64_t)m_resumeRead)/m_resumeAt;
+    if(m_resumeRead<m_resumeAt)
+        return true;
+
+    // The running hash goes on from here if the write resumes.
+    MD5 hash=m_journalHash;
+    uint8_t digest[MD5::DIGEST_SIZE];
+    hash.final(digest);
+    m_progress=-1;
+    if(std::memcmp(digest, m_resumeHash, MD5::DIGEST_SIZE)==0)
+    {
+        m_setStatus("Resuming at ", m_resumeAt/1024, " KB");
+        m_beginWrite(m_resumeAt, image.fsize-m_resumeAt, image.fsize-m_resumeAt, false, true);
+    }
+    else
+    {
+        m_journalHash.reset();
+        m_beginWrite(0, image.fsize, image.fsize, false, true);
+    }
+    return true;
+}
+
+void FlashEngine::m_beginWrite(const uint32_t start, const uint32_t length, const uint32_t imageSize, const bool preDeflated, const bool journal)
+{
+    m_start=start;
+    m_length=length;
+    m_imageSize=imageSize;
+    m_preDeflated=preDeflated;
+    m_journal=journal;
+    m_phase=PHASE_ERASE;
+}
+
+// m_left counts down the raw bytes still to be read. A pre-deflated file is
+// read up to the end of its stream instead.
+uint32_t FlashEngine::m_readBlock(uint8_t *data)
+{
+    if(m_inflater)
+        return m_inflater->read(data, m_blockSize);
+    int count=m_file->read(data, (m_blockSize<m_left) ? m_blockSize : m_left);
+    if(count<=0)
+        return 0;
+    m_left-=count;
+    return count;
+}
+
+// Order the images by offset and check their erases can't reach into each
+// other: every image starts on a sector and no two share a sector. flashSize
+// 0 skips the size check.
+bool FlashEngine::m_planImages(const uint32_t flashSize)
+{
+    std::sort(m_images.begin(), m_images.end(), [](const sFlashImage &a, const sFlashImage &b) { return a.offset<b.offset; });
+
+    uint32_t erasedTo=0;
+    for(auto &image : m_images)
+    {
+        if(image.offset%ESPLoader::FLASH_SECTOR_SIZE!=0 || image.offset<erasedTo)
+            return m_fail("Images overlap or are unaligned");
+        erasedTo=image.offset+(image.imageSize+ESPLoader::FLASH_SECTOR_SIZE-1)/ESPLoader::FLASH_SECTOR_SIZE*ESPLoader::FLASH_SECTOR_SIZE;
+    }
+    if(flashSize && m_images.back().offset+m_images.back().imageSize>flashSize)
+        return m_fail("Image is larger than the flash");
+    return true;
+}
+
+// Where to resume the image, 0 unless the journal is for this very image.
+uint32_t FlashEngine::m_readJournal(const sFlashImage &image, uint8_t *md5)
+{
+    FileHandle *file=m_fs.open(m_journalName.c_str(), O_RDONLY );
+    if(!file)
+        return 0;
+    sJournal journal;
+    int count=file->read(&journal, sizeof(journal));
+    file->close();
+
+    journal.path[sizeof(journal.path)-1]=0;
+    if(count!=sizeof(journal) || journal.magic!=JOURNAL_MAGIC || journal.offset!=image.offset || journal.fsize!=image.fsize
+        || image.path.compare(0, sizeof(journal.path)-1, journal.path)!=0 || journal.done>=image.fsize
+        || journal.done%JOURNAL_INTERVAL!=0)
+        return 0;
+    std::memcpy(md5, journal.md5, MD5::DIGEST_SIZE);
+    return journal.done;
+}
+
+void FlashEngine::m_writeJournal(const sFlashImage &image, const uint32_t done)
+{
+    sJournal journal;
+    std::memset(&journal, 0, sizeof(journal));
+    journal.magic=JOURNAL_MAGIC;
+    journal.offset=image.offset;
+    journal.fsize=image.fsize;
+    journal.done=done;
+    MD5 hash=m_journalHash;
+    hash.final(journal.md5);
+    std::strncpy(journal.path, image.path.c_str(), sizeof(journal.path)-1);
+
+    FileHandle *file=m_fs.open(m_journalName.c_str(), O_WRONLY | O_CREAT | O_TRUNC );
+    if(!file)
+        return;
+    file->write(&journal, sizeof(journal));
+    file->close();
+}
+
+void FlashEngine::m_setStatus(const char *message, const int32_t value, const char *unit, const bool error)
+{
+    m_status=message;
+    m_statusValue=value;
+    m_statusUnit=unit;
+    m_statusError=error;
+    m_statusSeq++;
+}
+
+// Show the message before a step that takes a while. True if it was new, and
+// the step should return so the tick ends with it.
+bool FlashEngine::m_announce(const char *message)
+{
+    if(m_status==message)
+        return false;
+    m_setStatus(message);
+    return true;
+}
+
+// For ESP link errors only. Above the base rate they lower the ladder
+// and restart the image that failed; at the base rate the image is restarted
+// BASE_RATE_RETRIES times. Either way the ESP is reset, which leaves a clean
+// line. The images before it are already written. SD card errors go straight
+// to m_fail().
+bool FlashEngine::m_retry(const char *message)
+{
+    m_closeImage();
+    if(!m_loader->drop_baud())
+    {
+        if(m_stats.baseRateRetries>=BASE_RATE_RETRIES)
+            return m_fail(message);
+        m_stats.baseRateRetries++;
+    }
+    m_setStatus(message, -1, "", true);
+    m_phase=PHASE_CONNECT;
+    return true;
+}
+
+bool FlashEngine::m_fail(const char *message)
+{
+    m_setStatus(message, -1, "", true);
+    m_release();
+    m_phase=PHASE_FAILED;
+    return false;
+}
+
+void FlashEngine::m_closeImage(void)
+{
+    delete m_inflater;
+    m_inflater=nullptr;
+    if(m_file)
+    {
+        m_file->close();
+        m_file=nullptr;
+    }
+    m_progress=-1;
+}
+
+// Deleting the loader hands the UART back.
+void FlashEngine::m_release(void)
+{
+    m_closeImage();
+    delete m_loader;
+    m_loader=nullptr;
+    delete[] m_buffers[0];
+    delete[] m_buffers[1];
+    m_buffers[0]=m_buffers[1]=nullptr;
+    m_blockSize=0;
+    delete[] m_window;
+    m_window=nullptr;
+}
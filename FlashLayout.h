@@ -0,0 +1,53 @@
+#pragma once
+#include <mbed.h>
+
+// Sector and block arithmetic of the ESP8266's SPI flash, apart from the
+// loader so the host tests can check it.
+class FlashLayout
+{
+public:
+    static constexpr uint32_t SECTOR_SIZE=0x1000;
+    static constexpr uint32_t BLOCK_SIZE=0x10000;
+    static constexpr uint32_t SECTORS_PER_BLOCK=BLOCK_SIZE/SECTOR_SIZE;
+
+    // Erases as the flash does them: sectors up to the first 64 KB boundary,
+    // whole blocks, then the sectors left over.
+    struct sErasePlan { uint32_t sectors; uint32_t blocks; };
+    static sErasePlan erasePlan(const uint32_t offset, const uint32_t size)
+    {
+        sErasePlan plan={0, 0};
+        uint32_t sector=offset/SECTOR_SIZE;
+        uint32_t end=(offset+size+SECTOR_SIZE-1)/SECTOR_SIZE;
+        while(sector<end)
+        {
+            if(sector%SECTORS_PER_BLOCK==0 && end-sector>=SECTORS_PER_BLOCK)
+            {
+                plan.blocks++;
+                sector+=SECTORS_PER_BLOCK;
+            }
+            else
+            {
+                plan.sectors++;
+                sector++;
+            }
+        }
+        return plan;
+    }
+
+    // The ROM's erase routine counts the sectors before the first block
+    // boundary twice. The size to put in FLASH_BEGIN so that it erases just
+    // the sectors of the image, as esptool works it out.
+    static uint32_t eraseSize(const uint32_t offset, const uint32_t size)
+    {
+        uint32_t num_sectors = (size+SECTOR_SIZE-1)/SECTOR_SIZE;
+        uint32_t start_sector = offset/SECTOR_SIZE;
+
+        uint32_t head_sectors = SECTORS_PER_BLOCK - (start_sector%SECTORS_PER_BLOCK);
+        if(num_sectors<head_sectors)
+            head_sectors=num_sectors;
+        if(num_sectors <(2*head_sectors))
+            return (num_sectors+1)/2*SECTOR_SIZE;
+        else
+            return (num_sectors-head_sectors)*SECTOR_SIZE;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+#include <mbed.h>
+
+// Streaming MD5 (RFC 1321), small enough to hash an image block by block as
+// it is read from SD.
+class MD5
+{
+public:
+    static constexpr uint32_t DIGEST_SIZE=16;
+
+    MD5(void) { reset(); }
+
+    void reset(void);
+    void update(const void *data, size_t size);
+    void final(uint8_t *digest);
+
+private:
+    static constexpr uint8_t SHIFT[64]={
+        7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,
+        5,9,14,20,5,9,14,20,5,9,14,20,5,9,14,20,
+        4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,
+        6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21};
+    static constexpr uint32_t K[64]={
+        0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+        0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+        0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+        0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+        0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+        0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+        0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+        0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391};
+
+    uint32_t m_state[4];
+    uint8_t m_block[64];
+    uint32_t m_blockSize;
+    uint32_t m_length;
+
+    void m_transform(const uint8_t *block);
+};
+
+void MD5::reset(void)
+{
+    m_state[0]=0x67452301;
+    m_state[1]=0xefcdab89;
+    m_state[2]=0x98badcfe;
+    m_state[3]=0x10325476;
+    m_blockSize=0;
+    m_length=0;
+}
+
+void MD5::update(const void *data, size_t size)
+{
+    const uint8_t *in=reinterpret_cast<const uint8_t*>(data);
+    m_length+=size;
+
+    if(m_blockSize>0)
+    {
+        uint32_t chunk=64-m_blockSize;
+        if(chunk>size)
+            chunk=size;
+        std::memcpy(m_block+m_blockSize, in, chunk);
+        m_blockSize+=chunk;
+        in+=chunk;
+        size-=chunk;
+        if(m_blockSize<64)
+            return;
+        m_transform(m_block);
+        m_blockSize=0;
+    }
+
+    // Whole blocks straight from the caller's buffer.
+    for(; size>=64; in+=64, size-=64)
+        m_transform(in);
+
+    std::memcpy(m_block, in, size);
+    m_blockSize=size;
+}
+
+void MD5::final(uint8_t *digest)
+{
+    uint32_t bits=m_length<<3;
+    uint32_t bitsHigh=m_length>>29;
+
+    m_block[m_blockSize++]=0x80;
+    if(m_blockSize>56)
+    {
+        std::memset(m_block+m_blockSize, 0, 64-m_blockSize);
+        m_transform(m_block);
+        m_blockSize=0;
+    }
+    std::memset(m_block+m_blockSize, 0, 56-m_blockSize);
+    for(int i=0;i<4;i++)
+    {
+        m_block[56+i]=bits>>(8*i);
+        m_block[60+i]=bitsHigh>>(8*i);
+    }
+    m_transform(m_block);
+
+    for(int i=0;i<16;i++)
+        digest[i]=m_state[i/4]>>(8*(i%4));
+    reset();
+}
+
+void MD5::m_transform(const uint8_t *block)
+{
+    // Byte by byte, the block may not be word aligned.
+    uint32_t m[16];
+    for(int i=0;i<16;i++)
+        m[i]=block[4*i] | (block[4*i+1]<<8) | (block[4*i+2]<<16) | ((uint32_t)block[4*i+3]<<24);
+
+    uint32_t a=m_state[0], b=m_state[1], c=m_state[2], d=m_state[3];
+    for(int i=0;i<64;i++)
+    {
+        uint32_t f;
+        int g;
+        if(i<16)
+        {
+            f=(b&c)|(~b&d);
+            g=i;
+        }
+        else if(i<32)
+        {
+            f=(d&b)|(~d&c);
+            g=(5*i+1)&15;
+        }
+        else if(i<48)
+        {
+            f=b^c^d;
+            g=(3*i+5)&15;
+        }
+        else
+        {
+            f=c^(b|~d);
+            g=(7*i)&15;
+        }
+        f+=a+K[i]+m[g];
+        a=d;
+        d=c;
+        c=b;
+        b+=(f<<SHIFT[i])|(f>>(32-SHIFT[i]));
+    }
+    m_state[0]+=a;
+    m_state[1]+=b;
+    m_state[2]+=c;
+    m_state[3]+=d;
+}
@@ -0,0 +1,813 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2012 ARM Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/* Introduction
+ * ------------
+ * SD and MMC cards support a number of interfaces, but common to them all
+ * is one based on SPI. This is the one I'm implmenting because it means
+ * it is much more portable even though not so performant, and we already
+ * have the mbed SPI Interface!
+ *
+ * The main reference I'm using is Chapter 7, "SPI Mode" of:
+ *  http://www.sdcard.org/developers/tech/sdcard/pls/Simplified_Physical_Layer_Spec.pdf
+ *
+ * SPI Startup
+ * -----------
+ * The SD card powers up in SD mode. The SPI interface mode is selected by
+ * asserting CS low and sending the reset command (CMD0). The card will
+ * respond with a (R1) response.
+ *
+ * CMD8 is optionally sent to determine the voltage range supported, and
+ * indirectly determine whether it is a version 1.x SD/non-SD card or
+ * version 2.x. I'll just ignore this for now.
+ *
+ * ACMD41 is repeatedly issued to initialise the card, until "in idle"
+ * (bit 0) of the R1 response goes to '0', indicating it is initialised.
+ *
+ * You should also indicate whether the host supports High Capicity cards,
+ * and check whether the card is high capacity - i'll also ignore this
+ *
+ * SPI Protocol
+ * ------------
+ * The SD SPI protocol is based on transactions made up of 8-bit words, with
+ * the host starting every bus transaction by asserting the CS signal low. The
+ * card always responds to commands, data blocks and errors.
+ *
+ * The protocol supports a CRC, but by default it is off (except for the
+ * first reset CMD0, where the CRC can just be pre-calculated, and CMD8)
+ * I'll leave the CRC off I think!
+ *
+ * Standard capacity cards have variable data block sizes, whereas High
+ * Capacity cards fix the size of data block to 512 bytes. I'll therefore
+ * just always use the Standard Capacity cards with a block size of 512 bytes.
+ * This is set with CMD16.
+ *
+ * You can read and write single blocks (CMD17, CMD25) or multiple blocks
+ * (CMD18, CMD25). Both are left running while the host goes on
+ * sequentially, so each further block costs only its data token. A write
+ * stream's length isn't known when it opens, so there is no ACMD23 pre-erase.
+ * When the card gets a read command, it responds with a response token, and then a data
+ * token or an error.
+ *
+ * SPI Command Format
+ * ------------------
+ * Commands are 6-bytes long, containing the command, 32-bit argument, and CRC.
+ *
+ * +---------------+------------+------------+-----------+----------+--------------+
+ * | 01 | cmd[5:0] | arg[31:24] | arg[23:16] | arg[15:8] | arg[7:0] | crc[6:0] | 1 |
+ * +---------------+------------+------------+-----------+----------+--------------+
+ *
+ * As I'm not using CRC, I can fix that byte to what is needed for CMD0 (0x95)
+ *
+ * All Application Specific commands shall be preceded with APP_CMD (CMD55).
+ *
+ * SPI Response Format
+ * -------------------
+ * The main response format (R1) is a status byte (normally zero). Key flags:
+ *  idle - 1 if the card is in an idle state/initialising
+ *  cmd  - 1 if an illegal command code was detected
+ *
+ *    +-------------------------------------------------+
+ * R1 | 0 | arg | addr | seq | crc | cmd | erase | idle |
+ *    +-------------------------------------------------+
+ *
+ * R1b is the same, except it is followed by a busy signal (zeros) until
+ * the first non-zero byte when it is ready again.
+ *
+ * Data Response Token
+ * -------------------
+ * Every data block written to the card is acknowledged by a byte
+ * response token
+ *
+ * +----------------------+
+ * | xxx | 0 | status | 1 |
+ * +----------------------+
+ *              010 - OK!
+ *              101 - CRC Error
+ *              110 - Write Error
+ *
+ * Single Block Read and Write
+ * ---------------------------
+ *
+ * Block transfers have a byte header, followed by the data, followed
+ * by a 16-bit CRC. In our case, the data will always be 512 bytes.
+ *
+ * +------+---------+---------+- -  - -+---------+-----------+----------+
+ * | 0xFE | data[0] | data[1] |        | data[n] | crc[15:8] | crc[7:0] |
+ * +------+---------+---------+- -  - -+---------+-----------+----------+
+ */
+#include "SDCard.h"
+#include "mbed_debug.h"
+#include "pinmap.h"
+
+#define SD_COMMAND_TIMEOUT 5000
+
+// A card has to leave the idle state within 1 s of the first ACMD41.
+#define SD_INIT_TIMEOUT_MS 1000
+
+// The card is on SSP0 (P0_9, P0_8, P0_6). Data blocks bypass the SPI API and
+// keep its 8 byte FIFO full.
+#define SSP_FIFO_DEPTH 8
+#define SSP_SR_TNF     (1 << 1)
+#define SSP_SR_RNE     (1 << 2)
+
+// SSP tops out at half the 48 MHz PCLK, below a default speed card's 25 MHz,
+// so switching the card to high speed (CMD6) would gain nothing.
+#define SD_MAX_SSP_CLOCK 24000000
+#define SD_MIN_CLOCK     1000000
+
+// _readBlocks() and _writeBlocks() return this when the data itself went
+// wrong: a bad start token or a rejected data response. Only that can be
+// the clock's fault; a command the card refuses (R1) fails at any clock.
+#define SD_DATA_ERROR    2
+
+// USBHAL makes P0_6 its USB_CONNECT output when it starts.
+#define SSP0_SCK_P0_6_FUNC 2
+
+#define SD_DBG             0
+
+SDCard::SDCard(PinName mosi, PinName miso, PinName sclk, PinName cs) :
+    _tranSpeed(25000000), _clock(5000000), _spi(mosi, miso, sclk), _cs(cs), _sclk(sclk), _streaming(false), _streamBlock(0), _writing(false), _writeBlock(0), _busy(false) {
+    _cs = 1;
+    
+    //no init
+    _status = 0x01;
+    _readyMs = 0;
+}
+
+// Leave the card idle for whoever uses it next.
+SDCard::~SDCard() {
+    sync();
+    finish();
+}
+
+#define R1_IDLE_STATE           (1 << 0)
+#define R1_ERASE_RESET          (1 << 1)
+#define R1_ILLEGAL_COMMAND      (1 << 2)
+#define R1_COM_CRC_ERROR        (1 << 3)
+#define R1_ERASE_SEQUENCE_ERROR (1 << 4)
+#define R1_ADDRESS_ERROR        (1 << 5)
+#define R1_PARAMETER_ERROR      (1 << 6)
+
+// Types
+//  - v1.x Standard Capacity
+//  - v2.x Standard Capacity
+//  - v2.x High Capacity
+//  - Not recognised as an SD Card
+#define SDCARD_FAIL 0
+#define SDCARD_V1   1
+#define SDCARD_V2   2
+#define SDCARD_V2HC 3
+
+int SDCard::initialise_card() {
+    // Set to 100kHz for initialisation, and clock card with cs = 1
+    _spi.frequency(100000);
+    _cs = 1;
+    for (int i = 0; i < 16; i++) {
+        _spi.write(0xFF);
+    }
+    // send CMD0, should return with all zeros except IDLE STATE set (bit 0)
+    if (_cmd(0, 0) != R1_IDLE_STATE) {
+        debug("No disk, or could not put SD card in to SPI idle state\n");
+        return SDCARD_FAIL;
+    }
+    
+    // send CMD8 to determine whther it is ver 2.x
+    int r = _cmd8();
+    if (r == R1_IDLE_STATE) {
+        return initialise_card_v2();
+    } else if (r == (R1_IDLE_STATE | R1_ILLEGAL_COMMAND)) {
+        return initialise_card_v1();
+    } else {
+        debug("Not in idle state after sending CMD8 (not an SD card?)\n");
+        return SDCARD_FAIL;
+    }
+}
+
+// Both poll ACMD41 back to back until the card is ready, up to the deadline.
+int SDCard::initialise_card_v1() {
+    Timer t;
+    t.start();
+    while (t.read_ms() < SD_INIT_TIMEOUT_MS) {
+        _cmd(55, 0);
+        if (_cmd(41, 0) == 0) {
+            cdv = 512;
+            debug_if(SD_DBG, "\n\rInit: SEDCARD_V1\n\r");
+            return SDCARD_V1;
+        }
+    }
+    
+    debug("Timeout waiting for v1.x card\n");
+    return SDCARD_FAIL;
+}
+
+int SDCard::initialise_card_v2() {
+    Timer t;
+    t.start();
+    while (t.read_ms() < SD_INIT_TIMEOUT_MS) {
+        _cmd(55, 0);
+        if (_cmd(41, 0x40000000) == 0) {
+            _cmd58();
+            debug_if(SD_DBG, "\n\rInit: SDCARD_V2\n\r");
+            cdv = 1;
+            return SDCARD_V2;
+        }
+    }
+    
+    debug("Timeout waiting for v2.x card\n");
+    return SDCARD_FAIL;
+}
+
+// Only the first call sets the card up. Later ones, e.g. when the USB drive
+// takes over from the file system, just check it still answers (CMD13).
+int SDCard::initialize() {
+    Timer t;
+    t.start();
+    if (_status == 0x00) {
+        sync();
+        if (_cmd(13, 0) == 0) {
+            _fullSpeed();
+            _readyMs = t.read_ms();
+            return 0;
+        }
+        debug("Card lost, setting it up again\n");
+        _status = 0x01;
+    }
+    
+    int i = initialise_card();
+    debug_if(SD_DBG, "init card = %d\n", i);
+    _sectors = _sd_sectors();
+    
+    // Set block length to 512 (CMD16)
+    if (_cmd(16, 512) != 0) {
+        debug("Set 512-byte block timed out\n");
+        return 1;
+    }
+    
+    _fullSpeed();
+    
+    // OK
+    _status = 0x00;
+    _readyMs = t.read_ms();
+    
+    return 0;
+}
+
+uint32_t block_write = 0;
+uint8_t count_write = 0;
+const uint8_t* dataPtr_write = nullptr;
+int ret_write = 0;
+
+uint32_t block_read = 0;
+uint8_t count_read = 0;
+const uint8_t* dataPtr_read = nullptr;
+int ret_read = 0;
+
+int SDCard::write(const uint8_t* data, uint64_t block, uint32_t count) {
+    // a rejected block at a high clock: slow down and try again
+    int ret = _writeBlocks(data, block, count);
+    while (ret == SD_DATA_ERROR && _slowDown()) {
+        ret = _writeBlocks(data, block, count);
+    }
+    return ret;
+}
+
+int SDCard::read(uint8_t *data, uint64_t block, uint32_t count) {
+    // a bad data token at a high clock: slow down and try again
+    int ret = _readBlocks(data, block, count);
+    while (ret == SD_DATA_ERROR && _slowDown()) {
+        ret = _readBlocks(data, block, count);
+    }
+    return ret;
+}
+
+int SDCard::status() { return _status; }
+
+// Close the open read or write.
+int SDCard::sync() {
+    _stopRead();
+    _stopWrite();
+    return 0;
+}
+
+// Let the card finish programming the last blocks.
+void SDCard::finish() {
+    _finishBusy();
+}
+
+uint64_t SDCard::sectors() { return _sectors; }
+
+uint32_t SDCard::readyMs() { return _readyMs; }
+
+void SDCard::claimPins() {
+    if (_sclk == P0_6) {
+        pin_function(P0_6, SSP0_SCK_P0_6_FUNC);
+    }
+}
+
+// Run data transfers as fast as both the card and the SSP can go. A clock
+// lowered by _slowDown() only lasts until the card is initialized again.
+void SDCard::_fullSpeed() {
+    _clock = _tranSpeed < SD_MAX_SSP_CLOCK ? _tranSpeed : SD_MAX_SSP_CLOCK;
+    _spi.frequency(_clock);
+}
+
+// Halve the data clock after a data error. False once at the floor.
+bool SDCard::_slowDown() {
+    if (_clock <= SD_MIN_CLOCK) {
+        return false;
+    }
+    _clock /= 2;
+    if (_clock < SD_MIN_CLOCK) {
+        _clock = SD_MIN_CLOCK;
+    }
+    _spi.frequency(_clock);
+    debug_if(SD_DBG, "SD clock down to %d\n", _clock);
+    return true;
+}
+
+int SDCard::_writeBlocks(const uint8_t* data, uint64_t block, uint32_t count) {
+    _stopRead();
+    
+    // start a multiple block write (CMD25) unless the running one is already
+    // at this block
+    if (!_writing || block != _writeBlock) {
+        _stopWrite();
+        if (_cmd(25, block * cdv) != 0) {
+            ret_write = 1;
+            return 1;
+        }
+        _writing = true;
+        _writeBlock = block;
+    }
+    
+    block_write = (uint32_t)(block*cdv);
+    count_write = count;
+    dataPtr_write = data;
+    
+    // send the data blocks
+    for (uint32_t i = 0; i < count; i++) {
+        int r = _writeStreamBlock(data + i * 512);
+        if (r != 0) {
+            _stopWrite();
+            ret_write = r;
+            return r;
+        }
+        _writeBlock++;
+    }
+    ret_write = 0;
+    return 0;
+}
+
+int SDCard::_readBlocks(uint8_t *data, uint64_t block, uint32_t count) {
+    _stopWrite();
+    
+    // start a multiple block read (CMD18) unless the running one is already
+    // at this block
+    if (!_streaming || block != _streamBlock) {
+        _stopRead();
+        if (_cmd(18, block * cdv) != 0) {
+            ret_read = 1;
+            return 1;
+        }
+        _streaming = true;
+        _streamBlock = block;
+    }
+    
+    block_read = (uint32_t)(block*cdv);
+    count_read = count;
+    dataPtr_read = data;
+    
+    // receive the data
+    for (uint32_t i = 0; i < count; i++) {
+        if (_readStreamBlock(data + i * 512) != 0) {
+            _stopRead();
+            ret_read = SD_DATA_ERROR;
+            return SD_DATA_ERROR;
+        }
+        _streamBlock++;
+    }
+    ret_read = 0;
+    return 0;
+}
+
+int SDCard::_cmd(int cmd, int arg) {
+    _cs = 0;
+    _waitBusy();
+    
+    // send a command
+    _spi.write(0x40 | cmd);
+    _spi.write(arg >> 24);
+    _spi.write(arg >> 16);
+    _spi.write(arg >> 8);
+    _spi.write(arg >> 0);
+    _spi.write(0x95);
+    
+    // wait for the repsonse (response[7] == 0)
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        int response = _spi.write(0xFF);
+        if (!(response & 0x80)) {
+            _cs = 1;
+            _spi.write(0xFF);
+            return response;
+        }
+    }
+    _cs = 1;
+    _spi.write(0xFF);
+    return -1; // timeout
+}
+int SDCard::_cmdx(int cmd, int arg) {
+    _cs = 0;
+    _waitBusy();
+    
+    // send a command
+    _spi.write(0x40 | cmd);
+    _spi.write(arg >> 24);
+    _spi.write(arg >> 16);
+    _spi.write(arg >> 8);
+    _spi.write(arg >> 0);
+    _spi.write(0x95);
+    
+    // wait for the repsonse (response[7] == 0)
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        int response = _spi.write(0xFF);
+        if (!(response & 0x80)) {
+            return response;
+        }
+    }
+    _cs = 1;
+    _spi.write(0xFF);
+    return -1; // timeout
+}
+
+
+int SDCard::_cmd58() {
+    _cs = 0;
+    _waitBusy();
+    int arg = 0;
+    
+    // send a command
+    _spi.write(0x40 | 58);
+    _spi.write(arg >> 24);
+    _spi.write(arg >> 16);
+    _spi.write(arg >> 8);
+    _spi.write(arg >> 0);
+    _spi.write(0x95);
+    
+    // wait for the repsonse (response[7] == 0)
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        int response = _spi.write(0xFF);
+        if (!(response & 0x80)) {
+            int ocr = _spi.write(0xFF) << 24;
+            ocr |= _spi.write(0xFF) << 16;
+            ocr |= _spi.write(0xFF) << 8;
+            ocr |= _spi.write(0xFF) << 0;
+            _cs = 1;
+            _spi.write(0xFF);
+            return response;
+        }
+    }
+    _cs = 1;
+    _spi.write(0xFF);
+    return -1; // timeout
+}
+
+int SDCard::_cmd8() {
+    _cs = 0;
+    _waitBusy();
+    
+    // send a command
+    _spi.write(0x40 | 8); // CMD8
+    _spi.write(0x00);     // reserved
+    _spi.write(0x00);     // reserved
+    _spi.write(0x01);     // 3.3v
+    _spi.write(0xAA);     // check pattern
+    _spi.write(0x87);     // crc
+    
+    // wait for the repsonse (response[7] == 0)
+    for (int i = 0; i < SD_COMMAND_TIMEOUT * 1000; i++) {
+        char response[5];
+        response[0] = _spi.write(0xFF);
+        if (!(response[0] & 0x80)) {
+            for (int j = 1; j < 5; j++) {
+                response[j] = _spi.write(0xFF);
+            }
+            _cs = 1;
+            _spi.write(0xFF);
+            return response[0];
+        }
+    }
+    _cs = 1;
+    _spi.write(0xFF);
+    return -1; // timeout
+}
+
+int SDCard::_read(uint8_t *buffer, uint32_t length) {
+    _cs = 0;
+    
+    // wait for the start token; an error token has the top bits clear
+    int token = 0xFF;
+    for (int i = 0; i < SD_COMMAND_TIMEOUT && token == 0xFF; i++) {
+        token = _spi.write(0xFF);
+    }
+    if (token != 0xFE) {
+        _cs = 1;
+        _spi.write(0xFF);
+        return 1;
+    }
+    
+    // read data
+    _spiReadBlock(buffer, length);
+    _spi.write(0xFF); // checksum
+    _spi.write(0xFF);
+    
+    _cs = 1;
+    _spi.write(0xFF);
+    return 0;
+}
+
+// One block of a CMD18 read. CS stays low between blocks so the card keeps
+// its place in the stream.
+int SDCard::_readStreamBlock(uint8_t *buffer) {
+    _cs = 0;
+    
+    // wait for the start token; an error token has the top bits clear
+    int token = 0xFF;
+    for (int i = 0; i < SD_COMMAND_TIMEOUT && token == 0xFF; i++) {
+        token = _spi.write(0xFF);
+    }
+    if (token != 0xFE) {
+        return 1;
+    }
+    
+    // read data
+    _spiReadBlock(buffer, 512);
+    _spi.write(0xFF); // checksum
+    _spi.write(0xFF);
+    return 0;
+}
+
+// End a CMD18 read with STOP_TRANSMISSION (CMD12).
+void SDCard::_stopRead() {
+    if (!_streaming) {
+        return;
+    }
+    _streaming = false;
+    
+    _cs = 0;
+    _spi.write(0x40 | 12);
+    _spi.write(0x00);
+    _spi.write(0x00);
+    _spi.write(0x00);
+    _spi.write(0x00);
+    _spi.write(0x95);
+    
+    // skip the stuff byte, then wait for R1 and the end of busy
+    _spi.write(0xFF);
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        if (!(_spi.write(0xFF) & 0x80)) {
+            break;
+        }
+    }
+    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
+        if (_spi.write(0xFF) != 0) {
+            break;
+        }
+    }
+    _cs = 1;
+    _spi.write(0xFF);
+}
+
+// One block of a CMD25 write. The card programs it while the next one comes
+// in over USB, so the busy wait is at the start of the next block instead of
+// the end of this one.
+int SDCard::_writeStreamBlock(const uint8_t *buffer) {
+    _cs = 0;
+    if (_waitBusy() != 0) {
+        return 1;
+    }
+    
+    // multiple block write start token
+    _spi.write(0xFC);
+    
+    // write the data
+    _spiWriteBlock(buffer, 512);
+    
+    // write the checksum
+    _spi.write(0xFF);
+    _spi.write(0xFF);
+    
+    // check the response token; 0x0D is the card failing to program the
+    // block, anything else the data not arriving intact
+    int response = _spi.write(0xFF) & 0x1F;
+    if (response == 0x0D) {
+        return 1;
+    }
+    if (response != 0x05) {
+        return SD_DATA_ERROR;
+    }
+    _busy = true;
+    return 0;
+}
+
+// Clock until the card releases busy (MISO held low). CS must be low.
+int SDCard::_waitReady() {
+    for (int i = 0; i < SD_COMMAND_TIMEOUT * 100; i++) {
+        if (_spi.write(0xFF) == 0xFF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The busy wait left over from the last write, if any. CS must be low; the
+// card shows busy again once it is reselected.
+int SDCard::_waitBusy() {
+    if (!_busy) {
+        return 0;
+    }
+    _busy = false;
+    return _waitReady();
+}
+
+// Let the card finish programming before it is left alone.
+void SDCard::_finishBusy() {
+    if (!_busy) {
+        return;
+    }
+    _cs = 0;
+    _waitBusy();
+    _cs = 1;
+    _spi.write(0xFF);
+}
+
+// End a CMD25 write with the stop token. The card programs what it still
+// holds while the next request comes in.
+void SDCard::_stopWrite() {
+    if (!_writing) {
+        return;
+    }
+    _writing = false;
+    
+    _cs = 0;
+    _waitBusy();
+    _spi.write(0xFD);
+    _spi.write(0xFF);
+    _busy = true;
+    _cs = 1;
+    _spi.write(0xFF);
+}
+
+int SDCard::_write(const uint8_t*buffer, uint32_t length) {
+    _cs = 0;
+    _waitBusy();
+    
+    // indicate start of block
+    _spi.write(0xFE);
+    
+    // write the data
+    _spiWriteBlock(buffer, length);
+    
+    // write the checksum
+    _spi.write(0xFF);
+    _spi.write(0xFF);
+    
+    // check the response token
+    if ((_spi.write(0xFF) & 0x1F) != 0x05) {
+        _cs = 1;
+        _spi.write(0xFF);
+        return 1;
+    }
+    
+    // the card programs the block while the next request comes in
+    _busy = true;
+    
+    _cs = 1;
+    _spi.write(0xFF);
+    return 0;
+}
+
+// Clock in a block with 0xFF, keeping up to a FIFO's worth of bytes in
+// flight so the bus doesn't idle between them. The SPI API leaves the receive
+// FIFO empty, so every byte read back belongs to this block.
+void SDCard::_spiReadBlock(uint8_t *buffer, uint32_t length) {
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    while (received < length) {
+        while (sent < length && sent - received < SSP_FIFO_DEPTH && (LPC_SSP0->SR & SSP_SR_TNF)) {
+            LPC_SSP0->DR = 0xFF;
+            sent++;
+        }
+        while (LPC_SSP0->SR & SSP_SR_RNE) {
+            buffer[received++] = LPC_SSP0->DR;
+        }
+    }
+}
+
+// The same for sending; what comes back is dropped.
+void SDCard::_spiWriteBlock(const uint8_t *buffer, uint32_t length) {
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    while (received < length) {
+        while (sent < length && sent - received < SSP_FIFO_DEPTH && (LPC_SSP0->SR & SSP_SR_TNF)) {
+            LPC_SSP0->DR = buffer[sent++];
+        }
+        while (LPC_SSP0->SR & SSP_SR_RNE) {
+            (void)LPC_SSP0->DR;
+            received++;
+        }
+    }
+}
+
+static uint32_t ext_bits(unsigned char *data, int msb, int lsb) {
+    uint32_t bits = 0;
+    uint32_t size = 1 + msb - lsb;
+    for (int i = 0; i < size; i++) {
+        uint32_t position = lsb + i;
+        uint32_t byte = 15 - (position >> 3);
+        uint32_t bit = position & 0x7;
+        uint32_t value = (data[byte] >> bit) & 1;
+        bits |= value << i;
+    }
+    return bits;
+}
+
+uint64_t SDCard::_sd_sectors() {
+    uint32_t c_size, c_size_mult, read_bl_len;
+    uint32_t block_len, mult, blocknr, capacity;
+    uint32_t hc_c_size;
+    uint64_t blocks;
+    
+    // CMD9, Response R2 (R1 byte + 16-byte block read)
+    if (_cmdx(9, 0) != 0) {
+        debug("Didn't get a response from the disk\n");
+        return 0;
+    }
+    
+    uint8_t csd[16];
+    if (_read(csd, 16) != 0) {
+        debug("Couldn't read csd response from disk\n");
+        return 0;
+    }
+    
+    // csd_structure : csd[127:126]
+    // c_size        : csd[73:62]
+    // c_size_mult   : csd[49:47]
+    // read_bl_len   : csd[83:80] - the *maximum* read block length
+    
+    int csd_structure = ext_bits(csd, 127, 126);
+    
+    // tran_speed    : csd[103:96] - time value * rate unit
+    static const uint8_t time_value[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    static const uint32_t rate_unit[4] = {10000, 100000, 1000000, 10000000};
+    uint32_t tran_speed = ext_bits(csd, 103, 96);
+    if ((tran_speed & 0x07) < 4 && time_value[(tran_speed >> 3) & 0x0F] != 0) {
+        _tranSpeed = time_value[(tran_speed >> 3) & 0x0F] * rate_unit[tran_speed & 0x07];
+    }
+    
+    switch (csd_structure) {
+        case 0:
+            cdv = 512;
+            c_size = ext_bits(csd, 73, 62);
+            c_size_mult = ext_bits(csd, 49, 47);
+            read_bl_len = ext_bits(csd, 83, 80);
+            
+            block_len = 1 << read_bl_len;
+            mult = 1 << (c_size_mult + 2);
+            blocknr = (c_size + 1) * mult;
+            capacity = blocknr * block_len;
+            blocks = capacity / 512;
+            debug_if(SD_DBG, "\n\rSDCard\n\rc_size: %d \n\rcapacity: %ld \n\rsectors: %lld\n\r", c_size, capacity, blocks);
+            break;
+        
+        case 1:
+            cdv = 1;
+            hc_c_size = ext_bits(csd, 63, 48);
+            blocks = (hc_c_size+1)*1024;
+            debug_if(SD_DBG, "\n\rSDHC Card \n\rhc_c_size: %d\n\rcapacity: %lld \n\rsectors: %lld\n\r", hc_c_size, blocks*512, blocks);
+            break;
+        
+        default:
+            debug("CSD struct unsupported\r\n");
+            return 0;
+    };
+    return blocks;
+}
@@ -0,0 +1,147 @@
+/* mbed SDCard Library, for block access to SD cards
+ * Copyright (c) 2008-2010, sford
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#include "mbed.h"
+
+extern uint32_t block_write;
+extern uint8_t count_write;
+extern const uint8_t* dataPtr_write;
+extern int ret_write;
+
+extern uint32_t block_read;
+extern uint8_t count_read;
+extern const uint8_t* dataPtr_read;
+extern int ret_read;
+
+/** Block access to an SD card over SPI
+ *
+ * The one driver for the card. The USB drive (USBMSD_SD) and the file system
+ * (SDCardFileSystem) both sit on top of it, so the card is set up once. When
+ * one hands over to the other it is only checked, and its clock goes back to
+ * full speed.
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDCard.h"
+ *
+ * SDCard card(p5, p6, p7, p8);
+ *
+ * int main() {
+ *   uint8_t block[512];
+ *   card.initialize();
+ *   card.read(block, 0, 1);
+ * }
+ *
+ * @endcode
+ */
+class SDCard {
+public:
+
+    /** Create the driver for an SD Card using SPI
+     *
+     * @param mosi SPI mosi pin connected to SD Card
+     * @param miso SPI miso pin conencted to SD Card
+     * @param sclk SPI sclk pin connected to SD Card
+     * @param cs   DigitalOut pin used as SD Card chip select
+     */
+    SDCard(PinName mosi, PinName miso, PinName sclk, PinName cs);
+    ~SDCard();
+    
+    /** Set the card up. Returns 0 on success, also when it already was. */
+    int initialize();
+    int status();
+    int read(uint8_t *data, uint64_t block, uint32_t count);
+    int write(const uint8_t *data, uint64_t block, uint32_t count);
+    
+    /** Close a running multiple block read or write. */
+    int sync();
+    
+    /** True while a multiple block read or write is open. */
+    bool open() { return _streaming || _writing; }
+    
+    /** Wait until the card has programmed everything written. */
+    void finish();
+    
+    /** Give the clock pin back to SSP0 after USB took it. */
+    void claimPins();
+    
+    /** How long the last initialize() took until the card was ready, in ms. */
+    uint32_t readyMs();
+    uint64_t sectors();
+
+protected:
+
+    int _cmd(int cmd, int arg);
+    int _cmdx(int cmd, int arg);
+    int _cmd8();
+    int _cmd58();
+    int initialise_card();
+    int initialise_card_v1();
+    int initialise_card_v2();
+    
+    int _readBlocks(uint8_t *data, uint64_t block, uint32_t count);
+    int _writeBlocks(const uint8_t *data, uint64_t block, uint32_t count);
+    void _fullSpeed();
+    bool _slowDown();
+    
+    int _read(uint8_t * buffer, uint32_t length);
+    int _write(const uint8_t *buffer, uint32_t length);
+    int _readStreamBlock(uint8_t *buffer);
+    void _stopRead();
+    int _writeStreamBlock(const uint8_t *buffer);
+    int _waitReady();
+    int _waitBusy();
+    void _finishBusy();
+    void _stopWrite();
+    void _spiReadBlock(uint8_t *buffer, uint32_t length);
+    void _spiWriteBlock(const uint8_t *buffer, uint32_t length);
+    uint64_t _sd_sectors();
+    uint64_t _sectors;
+    uint32_t _tranSpeed;  // Card's top clock from the CSD, in Hz.
+    uint32_t _clock;      // Data transfer clock in use.
+    
+    uint8_t _status;
+    uint32_t _readyMs;
+    
+    SPI _spi;
+    DigitalOut _cs;
+    PinName _sclk;
+    int cdv;
+    
+    // An open CMD18 read and the block it delivers next. Sequential host
+    // reads continue it; anything else stops it first.
+    bool _streaming;
+    uint64_t _streamBlock;
+    
+    // The same for an open CMD25 write.
+    bool _writing;
+    uint64_t _writeBlock;
+    
+    // The card is still programming the last block written. Whatever talks
+    // to it next waits for that first.
+    bool _busy;
+};
+
+#endif
@@ -0,0 +1,45 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2012 ARM Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "SDCardFileSystem.h"
+
+SDCardFileSystem::SDCardFileSystem(SDCard &card, const char* name) :
+    FATFileSystem(name), _card(card) {
+}
+
+// Close the card's running transfer for whoever uses it next.
+SDCardFileSystem::~SDCardFileSystem() {
+    _card.sync();
+}
+
+int SDCardFileSystem::disk_initialize() { return _card.initialize(); }
+int SDCardFileSystem::disk_status() { return _card.status(); }
+
+int SDCardFileSystem::disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    return _card.read(buffer, block_number, count);
+}
+
+int SDCardFileSystem::disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count) {
+    return _card.write(buffer, block_number, count);
+}
+
+int SDCardFileSystem::disk_sync() { return _card.sync(); }
+uint32_t SDCardFileSystem::disk_sectors() { return _card.sectors(); }
@@ -0,0 +1,69 @@
+/* mbed SDCardFileSystem Library, for providing file access to SD cards
+ * Copyright (c) 2008-2010, sford
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SDCARDFILESYSTEM_H
+#define SDCARDFILESYSTEM_H
+
+#include "mbed.h"
+#include "FATFileSystem.h"
+#include "SDCard.h"
+
+/** FAT file access to an SD card, on the driver the USB drive uses too
+ *
+ * @code
+ * #include "mbed.h"
+ * #include "SDCardFileSystem.h"
+ *
+ * SDCard card(p5, p6, p7, p8);
+ * SDCardFileSystem sd(card, "sd");
+ *
+ * int main() {
+ *   FILE *fp = fopen("/sd/myfile.txt", "w");
+ *   fprintf(fp, "Hello World!\n");
+ *   fclose(fp);
+ * }
+ *
+ * @endcode
+ */
+class SDCardFileSystem : public FATFileSystem {
+public:
+
+    /** Create the File System on an SD card
+     *
+     * @param card The card, initialized on the first access
+     * @param name The name used to access the virtual filesystem
+     */
+    SDCardFileSystem(SDCard &card, const char* name);
+    virtual ~SDCardFileSystem();
+    virtual int disk_initialize();
+    virtual int disk_status();
+    virtual int disk_read(uint8_t* buffer, uint32_t block_number, uint32_t count);
+    virtual int disk_write(const uint8_t* buffer, uint32_t block_number, uint32_t count);
+    virtual int disk_sync();
+    virtual uint32_t disk_sectors();
+
+protected:
+
+    SDCard &_card;
+};
+
+#endif
@@ -19,256 +19,222 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
-/* Introduction
- * ------------
- * SD and MMC cards support a number of interfaces, but common to them all
- * is one based on SPI. This is the one I'm implmenting because it means
- * it is much more portable even though not so performant, and we already
- * have the mbed SPI Interface!
- *
- * The main reference I'm using is Chapter 7, "SPI Mode" of:
- *  http://www.sdcard.org/developers/tech/sdcard/pls/Simplified_Physical_Layer_Spec.pdf
- *
- * SPI Startup
- * -----------
- * The SD card powers up in SD mode. The SPI interface mode is selected by
- * asserting CS low and sending the reset command (CMD0). The card will
- * respond with a (R1) response.
- *
- * CMD8 is optionally sent to determine the voltage range supported, and
- * indirectly determine whether it is a version 1.x SD/non-SD card or
- * version 2.x. I'll just ignore this for now.
- *
- * ACMD41 is repeatedly issued to initialise the card, until "in idle"
- * (bit 0) of the R1 response goes to '0', indicating it is initialised.
- *
- * You should also indicate whether the host supports High Capicity cards,
- * and check whether the card is high capacity - i'll also ignore this
- *
- * SPI Protocol
- * ------------
- * The SD SPI protocol is based on transactions made up of 8-bit words, with
- * the host starting every bus transaction by asserting the CS signal low. The
- * card always responds to commands, data blocks and errors.
- *
- * The protocol supports a CRC, but by default it is off (except for the
- * first reset CMD0, where the CRC can just be pre-calculated, and CMD8)
- * I'll leave the CRC off I think!
- *
- * Standard capacity cards have variable data block sizes, whereas High
- * Capacity cards fix the size of data block to 512 bytes. I'll therefore
- * just always use the Standard Capacity cards with a block size of 512 bytes.
- * This is set with CMD16.
- *
- * You can read and write single blocks (CMD17, CMD25) or multiple blocks
- * (CMD18, CMD25). For simplicity, I'll just use single block accesses. When
- * the card gets a read command, it responds with a response token, and then
- * a data token or an error.
- *
- * SPI Command Format
- * ------------------
- * Commands are 6-bytes long, containing the command, 32-bit argument, and CRC.
- *
- * +---------------+------------+------------+-----------+----------+--------------+
- * | 01 | cmd[5:0] | arg[31:24] | arg[23:16] | arg[15:8] | arg[7:0] | crc[6:0] | 1 |
- * +---------------+------------+------------+-----------+----------+--------------+
- *
- * As I'm not using CRC, I can fix that byte to what is needed for CMD0 (0x95)
- *
- * All Application Specific commands shall be preceded with APP_CMD (CMD55).
- *
- * SPI Response Format
- * -------------------
- * The main response format (R1) is a status byte (normally zero). Key flags:
- *  idle - 1 if the card is in an idle state/initialising
- *  cmd  - 1 if an illegal command code was detected
- *
- *    +-------------------------------------------------+
- * R1 | 0 | arg | addr | seq | crc | cmd | erase | idle |
- *    +-------------------------------------------------+
- *
- * R1b is the same, except it is followed by a busy signal (zeros) until
- * the first non-zero byte when it is ready again.
- *
- * Data Response Token
- * -------------------
- * Every data block written to the card is acknowledged by a byte
- * response token
- *
- * +----------------------+
- * | xxx | 0 | status | 1 |
- * +----------------------+
- *              010 - OK!
- *              101 - CRC Error
- *              110 - Write Error
- *
- * Single Block Read and Write
- * ---------------------------
- *
- * Block transfers have a byte header, followed by the data, followed
- * by a 16-bit CRC. In our case, the data will always be 512 bytes.
- *
- * +------+---------+---------+- -  - -+---------+-----------+----------+
- * | 0xFE | data[0] | data[1] |        | data[n] | crc[15:8] | crc[7:0] |
- * +------+---------+---------+- -  - -+---------+-----------+----------+
- */
 #include "USBMSD_SD.h"
 #include "mbed_debug.h"
 
-#define SD_COMMAND_TIMEOUT 5000
-
-#define SD_DBG             0
+#define USB_DEVCMDSTAT_DCON  (1 << 16)
+#define SYSAHBCLKCTRL_USB    (1 << 14)
 
-USBMSD_SD::USBMSD_SD(PinName mosi, PinName miso, PinName sclk, PinName cs) :
-    _spi(mosi, miso, sclk), _cs(cs) {
-    _cs = 1;
-    
-    //no init
-    _status = 0x01;
+USBMSD_SD::USBMSD_SD(SDCard &card) :
+    _card(card), _cacheTick(0), _lastWrite(0), _seenNext(0), _queueHead(0), _queueTail(0) {
+    // USBHAL has just taken the card's clock pin
+    _card.claimPins();
+    
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        _cache[i].valid = false;
+        _cache[i].dirty = false;
+    }
+    for (int i = 0; i < SEEN_SECTORS; i++) {
+        _seen[i] = (uint64_t)-1;
+    }
+    _idle.start();
     
     connect();
 }
 
-#define R1_IDLE_STATE           (1 << 0)
-#define R1_ERASE_RESET          (1 << 1)
-#define R1_ILLEGAL_COMMAND      (1 << 2)
-#define R1_COM_CRC_ERROR        (1 << 3)
-#define R1_ERASE_SEQUENCE_ERROR (1 << 4)
-#define R1_ADDRESS_ERROR        (1 << 5)
-#define R1_PARAMETER_ERROR      (1 << 6)
+// Leave the card idle for whoever uses it next.
+USBMSD_SD::~USBMSD_SD() {
+    _cacheFlush();
+    _card.finish();
+}
 
-// Types
-//  - v1.x Standard Capacity
-//  - v2.x Standard Capacity
-//  - v2.x High Capacity
-//  - Not recognised as an SD Card
-#define SDCARD_FAIL 0
-#define SDCARD_V1   1
-#define SDCARD_V2   2
-#define SDCARD_V2HC 3
+int USBMSD_SD::disk_initialize() {
+    return _card.initialize();
+}
 
-int USBMSD_SD::initialise_card() {
-    // Set to 100kHz for initialisation, and clock card with cs = 1
-    _spi.frequency(100000);
-    _cs = 1;
-    for (int i = 0; i < 16; i++) {
-        _spi.write(0xFF);
-    }
-    // send CMD0, should return with all zeros except IDLE STATE set (bit 0)
-    if (_cmd(0, 0) != R1_IDLE_STATE) {
-        debug("No disk, or could not put SD card in to SPI idle state\n");
-        return SDCARD_FAIL;
-    }
+uint32_t cache_hits = 0;
+uint32_t cache_misses = 0;
+uint32_t cache_flushes = 0;
+
+int USBMSD_SD::disk_write(const uint8_t* data, uint64_t block, uint8_t count) {
+    _idle.reset();
     
-    // send CMD8 to determine whther it is ver 2.x
-    int r = _cmd8();
-    if (r == R1_IDLE_STATE) {
-        return initialise_card_v2();
-    } else if (r == (R1_IDLE_STATE | R1_ILLEGAL_COMMAND)) {
-        return initialise_card_v1();
-    } else {
-        debug("Not in idle state after sending CMD8 (not an SD card?)\n");
-        return SDCARD_FAIL;
+    for (int i = 0; i < count; i++) {
+        const uint8_t *src = data + i * 512;
+        uint64_t b = block + i;
+        
+        // A cached sector takes the rewrite. A sector that doesn't continue
+        // the last write and was written before is likely metadata, so it
+        // gets a slot.
+        int slot = _cacheFind(b);
+        if (slot >= 0) {
+            cache_hits++;
+        } else if (b != _lastWrite + 1 && _rewritten(b)) {
+            cache_misses++;
+            slot = _cacheInsert(b);
+        }
+        _lastWrite = b;
+        
+        if (slot >= 0) {
+            memcpy(_cacheData[slot], src, 512);
+            _cache[slot].dirty = true;
+            _cache[slot].used = ++_cacheTick;
+        } else if (_card.write(src, b, 1) != 0) {
+            ret_write = 1;
+            return 1;
+        }
     }
+    ret_write = 0;
+    return 0;
 }
 
-int USBMSD_SD::initialise_card_v1() {
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        _cmd(55, 0);
-        if (_cmd(41, 0) == 0) {
-            cdv = 512;
-            debug_if(SD_DBG, "\n\rInit: SEDCARD_V1\n\r");
-            return SDCARD_V1;
+int USBMSD_SD::disk_read(uint8_t *data, uint64_t block, uint8_t count) {
+    _idle.reset();
+    
+    for (int i = 0; i < count; i++) {
+        uint8_t *dst = data + i * 512;
+        int slot = _cacheFind(block + i);
+        if (slot >= 0) {
+            cache_hits++;
+            memcpy(dst, _cacheData[slot], 512);
+            _cache[slot].used = ++_cacheTick;
+        } else if (_card.read(dst, block + i, 1) != 0) {
+            ret_read = 1;
+            return 1;
         }
     }
-    
-    debug("Timeout waiting for v1.x card\n");
-    return SDCARD_FAIL;
+    ret_read = 0;
+    return 0;
 }
 
-int USBMSD_SD::initialise_card_v2() {
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        wait_ms(50);
-        _cmd58();
-        _cmd(55, 0);
-        if (_cmd(41, 0x40000000) == 0) {
-            _cmd58();
-            debug_if(SD_DBG, "\n\rInit: SDCARD_V2\n\r");
-            cdv = 1;
-            return SDCARD_V2;
+int USBMSD_SD::_cacheFind(uint64_t block) {
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        if (_cache[i].valid && _cache[i].block == block) {
+            return i;
         }
     }
-    
-    debug("Timeout waiting for v2.x card\n");
-    return SDCARD_FAIL;
+    return -1;
 }
 
-int USBMSD_SD::disk_initialize() {
-    int i = initialise_card();
-    debug_if(SD_DBG, "init card = %d\n", i);
-    _sectors = _sd_sectors();
-    
-    // Set block length to 512 (CMD16)
-    if (_cmd(16, 512) != 0) {
-        debug("Set 512-byte block timed out\n");
-        return 1;
+// Take a free slot, or the least recently used one after writing it back.
+// -1 if that write fails; the caller then goes to the card directly.
+int USBMSD_SD::_cacheInsert(uint64_t block) {
+    int slot = 0;
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        if (!_cache[i].valid) {
+            slot = i;
+            break;
+        }
+        if (_cache[i].used < _cache[slot].used) {
+            slot = i;
+        }
     }
     
-    _spi.frequency(5000000); // Set to 5MHz for data transfer
-    
-    // OK
-    _status = 0x00;
-    
-    return 0;
+    if (_cache[slot].valid && _cache[slot].dirty) {
+        if (_card.write(_cacheData[slot], _cache[slot].block, 1) != 0) {
+            return -1;
+        }
+        cache_flushes++;
+    }
+    _cache[slot].block = block;
+    _cache[slot].valid = true;
+    _cache[slot].dirty = false;
+    return slot;
+}
+
+// True if the block is among the recent writes that didn't continue a run.
+// If not, it goes in place of the oldest one.
+bool USBMSD_SD::_rewritten(uint64_t block) {
+    for (int i = 0; i < SEEN_SECTORS; i++) {
+        if (_seen[i] == block) {
+            return true;
+        }
+    }
+    _seen[_seenNext] = block;
+    _seenNext = (_seenNext + 1) % SEEN_SECTORS;
+    return false;
 }
 
-uint32_t block_write = 0;
-uint8_t count_write = 0;
-const uint8_t* dataPtr_write = nullptr;
-int ret_write = 0;
+bool USBMSD_SD::_cacheDirty() {
+    for (int i = 0; i < CACHE_SECTORS; i++) {
+        if (_cache[i].valid && _cache[i].dirty) {
+            return true;
+        }
+    }
+    return false;
+}
 
-uint32_t block_read = 0;
-uint8_t count_read = 0;
-const uint8_t* dataPtr_read = nullptr;
-int ret_read = 0;
+// Write every dirty sector back, lowest first so neighbours share one CMD25.
+int USBMSD_SD::_cacheFlush() {
+    int ret = 0;
+    for (;;) {
+        int slot = -1;
+        for (int i = 0; i < CACHE_SECTORS; i++) {
+            if (_cache[i].valid && _cache[i].dirty && (slot < 0 || _cache[i].block < _cache[slot].block)) {
+                slot = i;
+            }
+        }
+        if (slot < 0) {
+            break;
+        }
+        if (_card.write(_cacheData[slot], _cache[slot].block, 1) != 0) {
+            _cache[slot].valid = false;  // don't retry it forever
+            ret = 1;
+        }
+        _cache[slot].dirty = false;
+        cache_flushes++;
+    }
+    _card.sync();
+    return ret;
+}
 
-int USBMSD_SD::disk_write(const uint8_t* data, uint64_t block, uint8_t count) { 
-    // set write address for single block (CMD24)
-    if (_cmd(24, block * cdv) != 0) {
-        ret_write = 1;
-        return 1;
+// Runs in the main loop. The USB interrupt is held off so no transfer is
+// queued halfway through the flush. Only after the host has
+// neither read nor written for a while, and only if there is something to
+// write back or a stream to close.
+void USBMSD_SD::flushIdle() {
+    if (_idle.read_ms() < CACHE_IDLE_MS) {
+        return;
     }
-    
-    block_write = (uint32_t)(block*cdv);
-    count_write = count;
-    dataPtr_write = data;
-    
-    // send the data block
-    _write(data, 512);
-    ret_write = 0;
-    return 0;
+    _idle.reset();
+    if (!_cacheDirty() && !_card.open()) {
+        return;
+    }
+    NVIC_DisableIRQ(USB_IRQn);
+    _cacheFlush();
+    NVIC_EnableIRQ(USB_IRQn);
 }
 
-int USBMSD_SD::disk_read(uint8_t *data, uint64_t block, uint8_t count) {
-    // set read address for single block (CMD17)
-    if (_cmd(17, block * cdv) != 0) {
-        ret_read = 1;
-        return 1;
+void USBMSD_SD::disconnect() {
+    NVIC_DisableIRQ(USB_IRQn);
+    _cacheFlush();
+    _card.finish();
+    NVIC_EnableIRQ(USB_IRQn);
+    USBMSD::disconnect();
+}
+
+bool USBMSD_SD::released() {
+    NVIC_DisableIRQ(USB_IRQn);
+    NVIC_ClearPendingIRQ(USB_IRQn);
+    if (!(LPC_SYSCON->SYSAHBCLKCTRL & SYSAHBCLKCTRL_USB)) {
+        return true;
+    }
+    if (LPC_USB->DEVCMDSTAT & USB_DEVCMDSTAT_DCON) {
+        debug("USB still connected\n");
+        return false;
     }
     
-    block_read = (uint32_t)(block*cdv);
-    count_read = count;
-    dataPtr_read = data;
-    
-    // receive the data
-    _read(data, 512);
-    ret_read = 0;
-    return 0;
+    // the USB RAM clock stays on, the RAM may be used for other things
+    LPC_SYSCON->SYSAHBCLKCTRL &= ~SYSAHBCLKCTRL_USB;
+    return true;
 }
 
-int USBMSD_SD::disk_status() { return _status; }
-int USBMSD_SD::disk_sync() { return 0; }
-uint64_t USBMSD_SD::disk_sectors() { return _sectors; }
+int USBMSD_SD::disk_status() { return _card.status(); }
+
+int USBMSD_SD::disk_sync() {
+    return _cacheFlush();
+}
+uint64_t USBMSD_SD::disk_sectors() { return _card.sectors(); }
 
 bool EPBULK_OUT_callback_ok = false;
 bool EPBULK_IN_callback_ok = false;
@@ -276,28 +242,79 @@ bool USBCallback_request_ok = false;
 bool USBCallback_setConfiguration_ok = false;
 
 //!!HV
-// Called in ISR context called when a data is received
+// Called in ISR context called when a data is received. The packet waits in
+// the endpoint for process(), the host is NAKed until then. Returning false
+// tells USBHAL to keep the endpoint's completion, which the readEP() in
+// USBMSD::EPBULK_OUT_callback() needs when process() gets to it.
 bool USBMSD_SD::EPBULK_OUT_callback() {
-    EPBULK_OUT_callback_ok = USBMSD::EPBULK_OUT_callback();
-    return EPBULK_OUT_callback_ok;  
-
+    _queuePush(EVENT_BULK_OUT);
+    return false;
 }
 
-// Called in ISR context when a data has been transferred
+// Called in ISR context when a data has been transferred. The next packet
+// is read from the card in process().
 bool USBMSD_SD::EPBULK_IN_callback() {
-    
-    EPBULK_IN_callback_ok = USBMSD::EPBULK_IN_callback();
-    return EPBULK_IN_callback_ok;  
+    _queuePush(EVENT_BULK_IN);
+    return false;
+}
+
+void USBMSD_SD::_queuePush(uint8_t event) {
+    uint8_t next = (_queueHead + 1) % QUEUE_SIZE;
+    if (next == _queueTail) {
+        debug("USB event queue full\n");
+        return;
+    }
+    _queue[_queueHead] = event;
+    _queueHead = next;
+}
+
+void USBMSD_SD::_runEvent(uint8_t event) {
+    if (event == EVENT_BULK_OUT) {
+        EPBULK_OUT_callback_ok = USBMSD::EPBULK_OUT_callback();
+    } else {
+        EPBULK_IN_callback_ok = USBMSD::EPBULK_IN_callback();
+    }
+}
+
+// A packet re-arms its endpoint, and the host's next one comes within
+// microseconds, so keep going until the host pauses or the time is up.
+// Nothing queued means the host is idle, and there is nothing to wait for.
+void USBMSD_SD::process() {
+    if (_queueTail == _queueHead) {
+        return;
+    }
+    Timer t;
+    t.start();
+    int lastEvent = 0;
+    while (t.read_ms() < WORKER_BUDGET_MS) {
+        if (_queueTail == _queueHead) {
+            if (t.read_us() - lastEvent > WORKER_IDLE_US) {
+                break;
+            }
+            continue;
+        }
+        
+        // the USB interrupt shares the driver state
+        NVIC_DisableIRQ(USB_IRQn);
+        uint8_t event = _queue[_queueTail];
+        _queueTail = (_queueTail + 1) % QUEUE_SIZE;
+        _runEvent(event);
+        NVIC_EnableIRQ(USB_IRQn);
+        lastEvent = t.read_us();
+    }
 }
 
 // Called in ISR context
 // Set configuration. Return false if the
 // configuration is not supported.
 bool USBMSD_SD::USBCallback_setConfiguration(uint8_t configuration) {
+    _queueTail = _queueHead;  // the endpoints start over
     USBCallback_setConfiguration_ok = USBMSD::USBCallback_setConfiguration(configuration);
     return USBCallback_setConfiguration_ok;
 }
 
+#define MSC_REQUEST_RESET 0xFF
+
 int32_t reqType = 0;
 int32_t request = 0;
 uint32_t request_remaining = 0;
@@ -311,230 +328,11 @@ bool USBMSD_SD::USBCallback_request(void) {
     request = transfer->setup.bRequest;
     request_remaining = transfer->remaining;
     
-    USBCallback_request_ok = USBMSD::USBCallback_request();
-    return USBCallback_request_ok;
-}
-
-
-// PRIVATE FUNCTIONS
-int USBMSD_SD::_cmd(int cmd, int arg) {
-    _cs = 0;
-    
-    // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
-    
-    // wait for the repsonse (response[7] == 0)
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
-        if (!(response & 0x80)) {
-            _cs = 1;
-            _spi.write(0xFF);
-            return response;
-        }
-    }
-    _cs = 1;
-    _spi.write(0xFF);
-    return -1; // timeout
-}
-int USBMSD_SD::_cmdx(int cmd, int arg) {
-    _cs = 0;
-    
-    // send a command
-    _spi.write(0x40 | cmd);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
-    
-    // wait for the repsonse (response[7] == 0)
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
-        if (!(response & 0x80)) {
-            return response;
-        }
-    }
-    _cs = 1;
-    _spi.write(0xFF);
-    return -1; // timeout
-}
-
-
-int USBMSD_SD::_cmd58() {
-    _cs = 0;
-    int arg = 0;
-    
-    // send a command
-    _spi.write(0x40 | 58);
-    _spi.write(arg >> 24);
-    _spi.write(arg >> 16);
-    _spi.write(arg >> 8);
-    _spi.write(arg >> 0);
-    _spi.write(0x95);
-    
-    // wait for the repsonse (response[7] == 0)
-    for (int i = 0; i < SD_COMMAND_TIMEOUT; i++) {
-        int response = _spi.write(0xFF);
-        if (!(response & 0x80)) {
-            int ocr = _spi.write(0xFF) << 24;
-            ocr |= _spi.write(0xFF) << 16;
-            ocr |= _spi.write(0xFF) << 8;
-            ocr |= _spi.write(0xFF) << 0;
-            _cs = 1;
-            _spi.write(0xFF);
-            return response;
-        }
-    }
-    _cs = 1;
-    _spi.write(0xFF);
-    return -1; // timeout
-}
-
-int USBMSD_SD::_cmd8() {
-    _cs = 0;
-    
-    // send a command
-    _spi.write(0x40 | 8); // CMD8
-    _spi.write(0x00);     // reserved
-    _spi.write(0x00);     // reserved
-    _spi.write(0x01);     // 3.3v
-    _spi.write(0xAA);     // check pattern
-    _spi.write(0x87);     // crc
-    
-    // wait for the repsonse (response[7] == 0)
-    for (int i = 0; i < SD_COMMAND_TIMEOUT * 1000; i++) {
-        char response[5];
-        response[0] = _spi.write(0xFF);
-        if (!(response[0] & 0x80)) {
-            for (int j = 1; j < 5; j++) {
-                response[i] = _spi.write(0xFF);
-            }
-            _cs = 1;
-            _spi.write(0xFF);
-            return response[0];
-        }
-    }
-    _cs = 1;
-    _spi.write(0xFF);
-    return -1; // timeout
-}
-
-int USBMSD_SD::_read(uint8_t *buffer, uint32_t length) {
-    _cs = 0;
-    
-    // read until start byte (0xFF)
-    while (_spi.write(0xFF) != 0xFE);
-    
-    // read data
-    for (int i = 0; i < length; i++) {
-        buffer[i] = _spi.write(0xFF);
-    }
-    _spi.write(0xFF); // checksum
-    _spi.write(0xFF);
-    
-    _cs = 1;
-    _spi.write(0xFF);
-    return 0;
-}
-
-int USBMSD_SD::_write(const uint8_t*buffer, uint32_t length) {
-    _cs = 0;
-    
-    // indicate start of block
-    _spi.write(0xFE);
-    
-    // write the data
-    for (int i = 0; i < length; i++) {
-        _spi.write(buffer[i]);
-    }
-    
-    // write the checksum
-    _spi.write(0xFF);
-    _spi.write(0xFF);
-    
-    // check the response token
-    if ((_spi.write(0xFF) & 0x1F) != 0x05) {
-        _cs = 1;
-        _spi.write(0xFF);
-        return 1;
+    // a mass storage reset re-arms the bulk endpoints, drop what they queued
+    if (reqType == CLASS_TYPE && request == MSC_REQUEST_RESET) {
+        _queueTail = _queueHead;
     }
     
-    // wait for write to finish
-    while (_spi.write(0xFF) == 0);
-    
-    _cs = 1;
-    _spi.write(0xFF);
-    return 0;
-}
-
-static uint32_t ext_bits(unsigned char *data, int msb, int lsb) {
-    uint32_t bits = 0;
-    uint32_t size = 1 + msb - lsb;
-    for (int i = 0; i < size; i++) {
-        uint32_t position = lsb + i;
-        uint32_t byte = 15 - (position >> 3);
-        uint32_t bit = position & 0x7;
-        uint32_t value = (data[byte] >> bit) & 1;
-        bits |= value << i;
-    }
-    return bits;
-}
-
-uint64_t USBMSD_SD::_sd_sectors() {
-    uint32_t c_size, c_size_mult, read_bl_len;
-    uint32_t block_len, mult, blocknr, capacity;
-    uint32_t hc_c_size;
-    uint64_t blocks;
-    
-    // CMD9, Response R2 (R1 byte + 16-byte block read)
-    if (_cmdx(9, 0) != 0) {
-        debug("Didn't get a response from the disk\n");
-        return 0;
-    }
-    
-    uint8_t csd[16];
-    if (_read(csd, 16) != 0) {
-        debug("Couldn't read csd response from disk\n");
-        return 0;
-    }
-    
-    // csd_structure : csd[127:126]
-    // c_size        : csd[73:62]
-    // c_size_mult   : csd[49:47]
-    // read_bl_len   : csd[83:80] - the *maximum* read block length
-    
-    int csd_structure = ext_bits(csd, 127, 126);
-    
-    switch (csd_structure) {
-        case 0:
-            cdv = 512;
-            c_size = ext_bits(csd, 73, 62);
-            c_size_mult = ext_bits(csd, 49, 47);
-            read_bl_len = ext_bits(csd, 83, 80);
-            
-            block_len = 1 << read_bl_len;
-            mult = 1 << (c_size_mult + 2);
-            blocknr = (c_size + 1) * mult;
-            capacity = blocknr * block_len;
-            blocks = capacity / 512;
-            debug_if(SD_DBG, "\n\rSDCard\n\rc_size: %d \n\rcapacity: %ld \n\rsectors: %lld\n\r", c_size, capacity, blocks);
-            break;
-        
-        case 1:
-            cdv = 1;
-            hc_c_size = ext_bits(csd, 63, 48);
-            blocks = (hc_c_size+1)*1024;
-            debug_if(SD_DBG, "\n\rSDHC Card \n\rhc_c_size: %d\n\rcapacity: %lld \n\rsectors: %lld\n\r", hc_c_size, blocks*512, blocks);
-            break;
-        
-        default:
-            debug("CSD struct unsupported\r\n");
-            return 0;
-    };
-    return blocks;
+    USBCallback_request_ok = USBMSD::USBCallback_request();
+    return USBCallback_request_ok;
 }
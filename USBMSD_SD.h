@@ -25,16 +25,12 @@
 
 #include "mbed.h"
 #include "USBMSD.h"
+#include "SDCard.h"
 
-extern uint32_t block_write;
-extern uint8_t count_write;
-extern const uint8_t* dataPtr_write;
-extern int ret_write;
-
-extern uint32_t block_read;
-extern uint8_t count_read;
-extern const uint8_t* dataPtr_read;
-extern int ret_read;
+// Write-back sector cache statistics.
+extern uint32_t cache_hits;
+extern uint32_t cache_misses;
+extern uint32_t cache_flushes;
 
 extern int32_t reqType;
 extern int32_t request;
@@ -51,7 +47,8 @@ extern bool USBCallback_setConfiguration_ok;
  * #include "mbed.h"
  * #include "USBMSD_SD.h"
  *
- * USBMSD_SD sd(p5, p6, p7, p8);
+ * SDCard card(p5, p6, p7, p8);
+ * USBMSD_SD sd(card);
  *
  * int main() {
  *   while(1);
@@ -62,15 +59,12 @@ extern bool USBCallback_setConfiguration_ok;
 class USBMSD_SD : public USBMSD {
 public:
 
-    /** Create the File System for accessing an SD Card using SPI
+    /** Offer an SD card to the USB host as a mass storage device
      *
-     * @param mosi SPI mosi pin connected to SD Card
-     * @param miso SPI miso pin conencted to SD Card
-     * @param sclk SPI sclk pin connected to SD Card
-     * @param cs   DigitalOut pin used as SD Card chip select
-     * @param name The name used to access the virtual filesystem
+     * @param card The card, possibly already initialized by the file system
      */
-    USBMSD_SD(PinName mosi, PinName miso, PinName sclk, PinName cs);
+    USBMSD_SD(SDCard &card);
+    virtual ~USBMSD_SD();
     virtual int disk_initialize();
     virtual int disk_status();
     //virtual int disk_read(uint8_t * buffer, uint64_t block_number);
@@ -80,7 +74,27 @@ public:
     virtual int disk_sync();
     virtual uint64_t disk_sectors();
     
-    virtual uint64_t disk_size(){return _sectors*512;};
+    virtual uint64_t disk_size(){return _card.sectors()*512;};
+    
+    /** Write the cached sectors back once the host has left the disk alone
+     * for a while. Call it from the main loop.
+     */
+    void flushIdle();
+    
+    /** Write the cached sectors back, then detach from USB. */
+    void disconnect();
+    
+    /** Check the USB device is off once the drive is deleted: detached, no
+     * interrupt enabled or pending. Then stop its clock.
+     *
+     * @returns true if it is off
+     */
+    static bool released();
+    
+    /** Do the bulk transfers the USB interrupt queued, for up to a frame's
+     * worth of time. Call it from the main loop.
+     */
+    void process();
     
     
 public:
@@ -109,24 +123,47 @@ public:
 
 protected:
 
-    int _cmd(int cmd, int arg);
-    int _cmdx(int cmd, int arg);
-    int _cmd8();
-    int _cmd58();
-    int initialise_card();
-    int initialise_card_v1();
-    int initialise_card_v2();
+    int _cacheFind(uint64_t block);
+    int _cacheInsert(uint64_t block);
+    bool _rewritten(uint64_t block);
+    int _cacheFlush();
+    bool _cacheDirty();
     
-    int _read(uint8_t * buffer, uint32_t length);
-    int _write(const uint8_t *buffer, uint32_t length);
-    uint64_t _sd_sectors();
-    uint64_t _sectors;
+    SDCard &_card;
     
-    uint8_t _status;
+    // Write-back cache for the sectors the host rewrites over and over, FAT
+    // and directory entries. Sequential writes, i.e. file data, go past it.
+    // A sector only gets a slot on its second write, so the first sector of
+    // each run of file data doesn't take one.
+    static const int CACHE_SECTORS = 4;
+    static const int SEEN_SECTORS = 8;
+    static const int CACHE_IDLE_MS = 500;
+    struct CacheEntry {
+        uint64_t block;
+        uint32_t used;
+        bool valid;
+        bool dirty;
+    };
+    CacheEntry _cache[CACHE_SECTORS];
+    uint8_t _cacheData[CACHE_SECTORS][512];
+    uint32_t _cacheTick;
+    uint64_t _lastWrite;
+    uint64_t _seen[SEEN_SECTORS];  // Recent writes that didn't continue a run.
+    int _seenNext;
+    Timer _idle;
     
-    SPI _spi;
-    DigitalOut _cs;
-    int cdv;
+    // Bulk endpoint events from the USB interrupt, done in process(). The
+    // endpoint stays NAKed until its event is done, so there is never more
+    // than one per endpoint: two events, plus the slot a ring keeps free.
+    static const int QUEUE_SIZE = 3;
+    static const int WORKER_BUDGET_MS = 40;
+    static const int WORKER_IDLE_US = 2000;
+    enum { EVENT_BULK_OUT, EVENT_BULK_IN };
+    volatile uint8_t _queue[QUEUE_SIZE];
+    volatile uint8_t _queueHead;
+    volatile uint8_t _queueTail;
+    void _queuePush(uint8_t event);
+    void _runEvent(uint8_t event);
 };
 
 #endif
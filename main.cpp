@@ -1,8 +1,10 @@
 #include "Pokitto.h"
-#include "SDFileSystem.h"   
+#include "SDCardFileSystem.h"
 #include "USBMSD_SD.h"
-#include "ESPLoader.h"
+#include "FlashEngine.h"
 #include <string>
+#include <vector>
+#include <cstdlib>
  
 using PC = Pokitto::Core;
 using PD = Pokitto::Display;
@@ -14,26 +16,53 @@ enum State
     stateConfirmFlashing,
     stateFlashESP,
     stateFlashingESPFinished,
+    stateFlashingESPFailed,
 };
 
+SDCard* sdCard = nullptr;  // Shared by the USB drive and the file system, set up once.
 USBMSD_SD* usbmsd_sd = nullptr;
-SDFileSystem *sdFs = nullptr;
+SDCardFileSystem *sdFs = nullptr;
+FlashEngine *flashEngine = nullptr;  // The last flashing run, kept for its stats.
 uint32_t prevBlock_read = 0;
 uint32_t prevBlock_write = 0;
 const int32_t margin = 14;
 const std::string ESPFlashfileName = "PokiPlusWifiLib.espfirm";
+// Lists several images as "<offset> <file>" lines, '#' starts a comment.
+// Takes precedence over ESPFlashfileName.
+const std::string ESPManifestName = "PokiPlusWifiLib.espman";
+// Progress of a write the ROM loader didn't finish, so a retry can resume.
+const std::string ESPJournalName = "PokiPlusWifiLib.espjrn";
 uint32_t* MAGIC_ADDRESS = (uint32_t*)0xE000ED0C;
 const uint32_t RESTART_MCU = 0x05FA0004;
 int32_t count=0;
 int32_t state=stateUSBDrive;
 bool firstTime = true;
+bool useManifest = false;
+// Time the flash engine works per frame. More flashes faster, less keeps the
+// screen and the cancel button livelier.
+const uint32_t FLASH_TICK_MS = 40;
+// The screen is only redrawn when it changes, and then only the part that
+// changed is sent to the LCD. Progress is redrawn at most 10 times a second.
+const int32_t STATUS_AREA_Y = 140;
+const uint32_t PROGRESS_INTERVAL_MS = 100;
+int32_t drawnState = -1;   // State whose screen is on the LCD, -1 to redraw.
+int32_t drawnStatus = -1;  // USB drive activity shown in the status area.
+int32_t progressShown = -1;
+uint32_t progressShownAt = 0;
+uint32_t statusShown = 0;  // Flash engine status on the LCD.
 
 void DrawPanel(int16_t x, int16_t y, int16_t w, int16_t h);
 template<class T>
 void PrintToStatusArea(int8_t color, T value);
 bool SDInit();
-bool flashFirmware(std::string path, const uint32_t flash_offset);
+bool findFlashFile();
+bool USBDriveStop();
+bool readManifest(const std::string &path, std::vector<sFlashImage> &images);
+bool startFlashing();
+void ShowFlashStatus();
 void PrintProgressBar(int32_t x, int32_t y, int32_t w, int32_t h, int8_t color, int8_t percentage);
+void UpdateStatusArea();
+bool ProgressDue(const uint32_t percentage);
 
 void init() 
 {
@@ -57,27 +86,8 @@ void init()
         PB::update();
         
     // Check the ESP flash image existence.
-    // Init the SD card.
-    bool ok = SDInit();
-    if(ok)
-    {
-        // Check the file existence.
-        wait_ms(2000);
-        FileHandle *file=sdFs->open(ESPFlashfileName.c_str(), O_RDWR );
-        if(file)
-        {
-            // Found ESP flash file. Start flashing.
-            state=stateConfirmFlashing;
-            file->close();
-        }
-    }
-    // Delete SDFS
-    if(sdFs)
-    {
-        sdFs->unmount();
-        delete(sdFs);
-        sdFs = nullptr;
-    }
+    if(findFlashFile())
+        state=stateConfirmFlashing;
 }
 
 
@@ -86,20 +96,31 @@ void update()
     if(PB::pressed(BTN_A))
     {
         //if(state==stateUSBDrive) state=stateConfirmUSBCableDisconnected;
-        if(state==stateConfirmFlashing) state=stateFlashESP;
+        if(state==stateConfirmFlashing || state==stateFlashingESPFailed) state=stateFlashESP;
         
-        // Restart Pokitto to be able to flash the ESP binary. If the restart is not made
-        // after the USB drive we cannot connect to ESP for some reason!
-        if(state==stateUSBDrive) *MAGIC_ADDRESS = RESTART_MCU;
+        // Take the USB drive down and look for the flash file, in the same
+        // boot. Restart Pokitto only if the USB device can't be shown to be off.
+        if(state==stateUSBDrive)
+        {
+            if(!USBDriveStop())
+                *MAGIC_ADDRESS = RESTART_MCU;
+            else if(findFlashFile())
+                state=stateConfirmFlashing;
+        }
     }
     else if(PB::pressed(BTN_B)) 
     {
         if(state==stateConfirmFlashing) state=stateUSBDrive;
+        if(state==stateFlashESP && flashEngine) flashEngine->cancel();
     }
     else if(PB::pressed(BTN_C) )
     {
         // Jump to the loader.
         
+        // Let go of the ESP UART and the flash files.
+        delete(flashEngine);
+        flashEngine = nullptr;
+        
         // Disconnect USB disk
         if(usbmsd_sd)
         {
@@ -121,88 +142,99 @@ void update()
         PC::jumpToLoader();
     }
         
+    // The USB drive's bulk transfers, queued by the USB interrupt.
+    if(usbmsd_sd)
+        usbmsd_sd->process();
+        
     // *** Handle states
+    
+    // A state draws its screen once, when it is entered.
+    bool redraw = state!=drawnState;
+    drawnState = state;
         
     if(state==stateUSBDrive)  // USB drive state 
     {
-        PD::setColor(13,0);
-        PD::fillRect(0, 0, 220, 176);
-        PD::setCursor(0,0);
+        // Write back the SD sector cache once the PC goes quiet.
+        if(usbmsd_sd)
+            usbmsd_sd->flushIdle();
+        
+        if(redraw)
+        {
+            PD::setColor(13,0);
+            PD::fillRect(0, 0, 220, 176);
+            PD::setCursor(0,0);
     
-        int32_t startY = 20;
-        DrawPanel(5, startY, 220-10, 176-60);
-        PD::setColor(9);  // orange
-        PD::print(margin,3,"*** ESP FLASHER ***\n\n");
-        PD::setColor(7);  // white
-        PD::println(margin, startY+3,    "Connect the USB cable and wait");
-        PD::println(margin, PD::cursorY, "for the USB drive to be ready");
-        PD::println(margin, PD::cursorY, "on PC. Then copy the ESP file");
-        PD::println(margin, PD::cursorY, "from PC to Pokitto.");
-        PD::println("");
-        PD::println(margin, PD::cursorY, "The ESP flash file name should be");
-        PD::setColor(10);  // yellow
-        PD::println(margin, PD::cursorY, ESPFlashfileName.c_str());
-        PD::println("");
-        PD::setColor(7);  // white
-        PD::println(margin, PD::cursorY, "When the file has been");
-        PD::println(margin, PD::cursorY, "copied, press A");
+            int32_t startY = 20;
+            DrawPanel(5, startY, 220-10, 176-60);
+            PD::setColor(9);  // orange
+            PD::print(margin,3,"*** ESP FLASHER ***\n\n");
+            PD::setColor(7);  // white
+            PD::println(margin, startY+3,    "Connect the USB cable and wait");
+            PD::println(margin, PD::cursorY, "for the USB drive to be ready");
+            PD::println(margin, PD::cursorY, "on PC. Then copy the ESP file");
+            PD::println(margin, PD::cursorY, "from PC to Pokitto.");
+            PD::println("");
+            PD::println(margin, PD::cursorY, "The ESP flash file name should be");
+            PD::setColor(10);  // yellow
+            PD::println(margin, PD::cursorY, ESPFlashfileName.c_str());
+            PD::println("");
+            PD::setColor(7);  // white
+            PD::println(margin, PD::cursorY, "When the file has been");
+            PD::println(margin, PD::cursorY, "copied, press A");
     
-        PD::setColor(10);  // yellow
-        if(firstTime)
-            PD::println(margin, 120, "A: File copied");
-        else
-            PD::println(margin, 120, "A: File copied      C: Cancel");
+            PD::setColor(10);  // yellow
+            if(firstTime)
+                PD::println(margin, 120, "A: File copied");
+            else
+                PD::println(margin, 120, "A: File copied      C: Cancel");
         
-        // Print to status area
-        int32_t statusAreaY = 140;
-        if(firstTime)
-        {
-            PD::setColor(8);  // red
-            PD::print(margin,statusAreaY, "Connect the USB cable !");
+            PD::update();
+            drawnStatus = -1;
         }
+        
+        // The status area shows the SD activity since the last frame, and is
+        // sent on its own when that changes.
+        int32_t status = 0;
+        if(firstTime)
+            status = 1;
         else if(block_write!=prevBlock_write)
-        {
-            PD::setColor(11);  // l.green
-            PD::print(margin,statusAreaY, "Writing to SD: ");
-            uint32_t now = PC::getTime();
-            if((now / 500)%3 == 0)
-                PD::println(".    .");
-            else if((now / 500)%3 == 1)
-                PD::println(" .  . ");
-            else 
-                PD::println("  ..  ");
-            //PD::println(block_write);
-            prevBlock_write = block_write;
-        }
+            status = 2;
         else if(block_read!=prevBlock_read)
+            status = 5;
+        if(status>=2)
+            status += (PC::getTime() / 500)%3;
+        prevBlock_write = block_write;
+        prevBlock_read = block_read;
+        
+        if(status!=drawnStatus)
         {
-            PD::setColor(11);  // l.green
-            PD::print(margin,statusAreaY, "Reading from SD: ");
-            uint32_t now = PC::getTime();
-            if((now / 500)%3 == 0)
-                PD::println(".    .");
-            else if((now / 500)%3 == 1)
-                PD::println(" .  . ");
-            else 
-                PD::println("  ..  ");
-            //PD::println(block_read);
-            prevBlock_read = block_read;
+            static const char * const dots[3] = {".    .", " .  . ", "  ..  "};
+            if(status==0)
+                PrintToStatusArea(11, "");
+            else if(status==1)
+                PrintToStatusArea(8, "Connect the USB cable !");
+            else
+            {
+                PrintToStatusArea(11, status<5 ? "Writing to SD: " : "Reading from SD: ");
+                PD::print(dots[(status-2)%3]);
+            }
+            UpdateStatusArea();
+            drawnStatus = status;
         }
-
-        PD::update();
         
         if(firstTime)
         {
             // Start USB disk.
             // Note, this call blocks until the cable is connected!
             //PD::print("USBMSD_SD called\n");
-            usbmsd_sd = new USBMSD_SD(P0_9, P0_8, P0_6, P0_7); // P0_9, P0_8, P0_6, P0_7 = pins for SD card
+            usbmsd_sd = new USBMSD_SD(*sdCard);
             //PD::print("USBMSD_SD done\n");
             firstTime = false;
+            drawnState = -1;
         }
     }  // end if state==stateUSBDrive
 
-    else if(state==stateConfirmFlashing)  // Disconnect cable view 
+    else if(state==stateConfirmFlashing && redraw)  // Disconnect cable view 
     {
         PD::setColor(13,0);
         PD::fillRect(0, 0, 220, 176);
@@ -214,7 +246,7 @@ void update()
         DrawPanel(5, startY+40, 220-10, 176-60-40);
         PD::setColor(7);
         PD::println(margin, startY+50+10, "The ESP flash file found in SD:");
-        PD::println(margin+10, PD::cursorY, ESPFlashfileName.c_str());
+        PD::println(margin+10, PD::cursorY, useManifest ? ESPManifestName.c_str() : ESPFlashfileName.c_str());
         PD::println();
         PD::println(margin, PD::cursorY,  "Press A to prodeed to flashing.");
      
@@ -227,56 +259,55 @@ void update()
     
     else if(state==stateFlashESP)  // ESP flashing state 
     {
-        PD::setColor(13,0);
-        PD::fillRect(0, 0, 220, 176);
-        PD::setCursor(0,0);
-    
-        int32_t startY = 20;
-        DrawPanel(5, startY, 220-10, 176-60);
-        PD::setColor(9);  // orange
-        PD::print(margin,3,"*** ESP FLASHER ***\n\n");
-        PD::setColor(7);
-        PD::println(margin, startY+10, "Flashing ESP: ");
-
-        PD::update();
-        
-        // Print to status area
-        PrintToStatusArea(11, "Disconnecting USB");
-        PD::update();
-        
-         // Disconnect USB disk
-        if(usbmsd_sd)
+        if(redraw)
         {
-            usbmsd_sd->disconnect();
-            delete(usbmsd_sd);
-            usbmsd_sd = nullptr;
-        }
+            PD::setColor(13,0);
+            PD::fillRect(0, 0, 220, 176);
+            PD::setCursor(0,0);
         
-        wait_ms(3000);
-        
-        // Print to status area
-        PrintToStatusArea(11, "Init SD card");
-        PD::update();
+            int32_t startY = 20;
+            DrawPanel(5, startY, 220-10, 176-60);
+            PD::setColor(9);  // orange
+            PD::print(margin,3,"*** ESP FLASHER ***\n\n");
+            PD::setColor(7);
+            PD::println(margin, startY+10, "Flashing ESP: ");
+            PD::setColor(10);  // yellow
+            PD::println(margin, 120, "B: Cancel");
+
+            PD::update();
+            
+            if(!startFlashing())
+                state=stateFlashingESPFailed;
+        }
         
-        // Init SD card
-        bool ok = SDInit();
-        if(ok)
+        // The engine does a frame's worth of work, then the screen catches up.
+        if(state==stateFlashESP)
         {
-            wait_ms(2000);
-            ok = flashFirmware(ESPFlashfileName, 0);
+            flashEngine->tick(FLASH_TICK_MS);
+            ShowFlashStatus();
+            if(!flashEngine->busy())
+            {
+                bool ok = flashEngine->succeeded();
+                
+                // The engine removed the flashed files, so drop the manifest
+                // too. Otherwise its status says why they were kept.
+                if(ok)
+                {
+                    if(useManifest)
+                        sdFs->remove(ESPManifestName.c_str());
+                    PrintToStatusArea(11, "ESP flashing done!");
+                    UpdateStatusArea();
+                }
+                
+                // On an error stay on the status message and offer a retry.
+                // A ROM write resumes from its journal.
+                state=ok ? stateFlashingESPFinished : stateFlashingESPFailed;
+            }
         }
         
-        // Print to status area
-        if(ok)
-            PrintToStatusArea(11, "ESP flashing done!");
-        PD::update();
-
-        state=stateFlashingESPFinished; // finished
-        if(!ok) for(;;); // Loop forever in case of error.
-        
     } // end if state==stateFlashESP
     
-    else if(state==stateFlashingESPFinished)  // Flashing done. 
+    else if(state==stateFlashingESPFinished && redraw)  // Flashing done. 
     {
         PD::setColor(13,0);
         PD::fillRect(0, 0, 220, 176);
@@ -288,6 +319,14 @@ void update()
         PD::print(margin,3,"*** ESP FLASHER ***\n\n");
         PD::setColor(7);
         PD::println(margin, startY+10, "ESP flashing succeeded!");
+        const FlashEngine::sStats &stats = flashEngine->stats();
+        PD::println(margin, PD::cursorY, "SD reads hidden: ");
+        PD::print(stats.blocksSent ? (100*stats.readsHidden)/stats.blocksSent : 0);
+        PD::print(" %");
+        PD::println(margin, PD::cursorY, "Ready ms: SD ");
+        PD::print(sdCard ? sdCard->readyMs() : 0);
+        PD::print(", ESP ");
+        PD::print(stats.espReadyMs);
     
         PD::setColor(10);  // yellow
         PD::println(margin, 120, "C: Start loader");
@@ -295,6 +334,32 @@ void update()
         PD::update();
         
     } // end if state==stateFlashingESPFinished
+    
+    else if(state==stateFlashingESPFailed && redraw)  // Flashing failed.
+    {
+        // Leave the status area with the error alone.
+        PD::setColor(13,0);
+        PD::fillRect(0, 0, 220, 140);
+        PD::setCursor(0,0);
+    
+        int32_t startY = 20;
+        DrawPanel(5, startY, 220-10, 176-60);
+        PD::setColor(9);  // orange
+        PD::print(margin,3,"*** ESP FLASHER ***\n\n");
+        PD::setColor(7);
+        PD::println(margin, startY+10, "ESP flashing failed!");
+        PD::println(margin, PD::cursorY, "Check the cable and retry.");
+        PD::println(margin, PD::cursorY, "Block retries: ");
+        PD::print(flashEngine ? flashEngine->stats().blockRetries : 0);
+        PD::println(margin, PD::cursorY, "Base rate retries: ");
+        PD::print(flashEngine ? flashEngine->stats().baseRateRetries : 0);
+    
+        PD::setColor(10);  // yellow
+        PD::println(margin, 120, "A: Retry   C: Start loader");
+        
+        PD::update(false, 0, 0, 220, STATUS_AREA_Y);
+        
+    } // end if state==stateFlashingESPFailed
 }
 
 void DrawPanel(int16_t x, int16_t y, int16_t w, int16_t h)
@@ -316,15 +381,32 @@ template<class T>
 void PrintToStatusArea(int8_t color, T value)
 {
     // Print to status area
-    int32_t statusAreaY = 140;
     PD::setColor(13,0);
-    PD::fillRect(0, statusAreaY, 220, 176-statusAreaY);
+    PD::fillRect(0, STATUS_AREA_Y, 220, 176-STATUS_AREA_Y);
     
-    PD::setCursor(margin, statusAreaY);
+    PD::setCursor(margin, STATUS_AREA_Y);
     PD::setColor(color); 
     PD::print(value);
 }        
 
+// Send just the status area to the LCD.
+void UpdateStatusArea()
+{
+    PD::update(false, 0, STATUS_AREA_Y, 220, 176-STATUS_AREA_Y);
+}
+
+// True when a changed progress value may be drawn. Set progressShown to -1
+// before a new run so its first value always shows.
+bool ProgressDue(const uint32_t percentage)
+{
+    uint32_t now=PC::getTime();
+    if((int32_t)percentage==progressShown || (progressShown>=0 && now-progressShownAt<PROGRESS_INTERVAL_MS))
+        return false;
+    progressShown=percentage;
+    progressShownAt=now;
+    return true;
+}
+
 void PrintProgressBar(int32_t x, int32_t y, int32_t w, int32_t h, int8_t color, int8_t percentage)
 {
     // Clear area
@@ -342,88 +424,188 @@ bool SDInit()
 {
     if(sdFs) return true;
     
-    sdFs = new SDFileSystem( P0_9, P0_8, P0_6, P0_7, "sd", NC, SDFileSystem::SWITCH_NONE, 25000000 );
-    sdFs->crc(false);
-    sdFs->write_validation(false);
-    //sdFs->large_frames(true);
-
-    if(sdFs->card_type()==SDFileSystem::CardType::CARD_UNKNOWN)
+    if(!sdCard)
+        sdCard = new SDCard(P0_9, P0_8, P0_6, P0_7); // P0_9, P0_8, P0_6, P0_7 = pins for SD card
+    
+    // Only the first call initializes the card.
+    if(sdCard->initialize()!=0)
     {
         // Print to status area
         PrintToStatusArea(8, "SD card initialization failed!");
-        PD::update();
+        UpdateStatusArea();
         return false;
     }
     
+    sdFs = new SDCardFileSystem(*sdCard, "sd");
     return true;
 }
 
-bool flashFirmware(std::string path, const uint32_t flash_offset)
+// Look for the manifest, or else the single flash file, on the SD card.
+bool findFlashFile()
 {
-    FileHandle *file=sdFs->open(path.c_str(), O_RDWR );
-    
-    if(!file)
+    bool found=false;
+    if(SDInit())
     {
-        PrintToStatusArea(8, "File open failed");
-        PD::update();
-        return false;
+        // A manifest wins over the single file.
+        FileHandle *file=sdFs->open(ESPManifestName.c_str(), O_RDONLY );
+        useManifest=file!=nullptr;
+        if(!file)
+            file=sdFs->open(ESPFlashfileName.c_str(), O_RDWR );
+        if(file)
+        {
+            found=true;
+            file->close();
+        }
+    }
+    // Delete SDFS
+    if(sdFs)
+    {
+        sdFs->unmount();
+        delete(sdFs);
+        sdFs = nullptr;
     }
-    ESPLoader Loader(230400);//460800
+    return found;
+}
 
-    uint32_t fsize=file->flen();
-    PrintToStatusArea(11, "Connecting to ESP8266 Module");
-    PD::update();
-    Loader.enterBootLoader();
-    wait_ms(1000);
+// Release the USB drive completely: cached sectors written back, the bus
+// detached and the USB device checked to be off. Next time the USB drive
+// state comes round it starts a new one.
+bool USBDriveStop()
+{
+    if(!usbmsd_sd)
+        return true;
+    usbmsd_sd->disconnect();
+    delete(usbmsd_sd);
+    usbmsd_sd = nullptr;
+    firstTime = true;
+    drawnState = -1;
+    return USBMSD_SD::released();
+}
 
-    if(Loader.sync())
+bool readManifest(const std::string &path, std::vector<sFlashImage> &images)
+{
+    FileHandle *file=sdFs->open(path.c_str(), O_RDONLY );
+    if(!file)
     {
-        if(Loader.flash_begin(fsize, flash_offset))
+        PrintToStatusArea(8, "Manifest open failed");
+        UpdateStatusArea();
+        return false;
+    }
+    std::string text;
+    char buffer[128];
+    int count;
+    while((count=file->read(buffer, sizeof(buffer)))>0)
+        text.append(buffer, count);
+    file->close();
+    
+    size_t pos=0;
+    while(pos<text.size())
+    {
+        size_t end=text.find('\n', pos);
+        if(end==std::string::npos)
+            end=text.size();
+        std::string line=text.substr(pos, end-pos);
+        pos=end+1;
+        
+        size_t hash=line.find('#');
+        if(hash!=std::string::npos)
+            line.erase(hash);
+        size_t first=line.find_first_not_of(" \t\r");
+        if(first==std::string::npos)
+            continue;
+        
+        char *rest;
+        uint32_t offset=std::strtoul(line.c_str()+first, &rest, 0);
+        std::string name(rest);
+        size_t nameStart=name.find_first_not_of(" \t");
+        size_t nameEnd=name.find_last_not_of(" \t\r");
+        if(rest==line.c_str()+first || nameStart==std::string::npos)
         {
-            uint8_t data[Loader.FLASH_WRITE_SIZE];
-            uint32_t parts=(fsize+Loader.FLASH_WRITE_SIZE-1)/Loader.FLASH_WRITE_SIZE;
-            for(auto i=0;i<parts;i++)
-            {
-                // Draw status area text.
-                PrintToStatusArea(11, "Flashing Firmware: ");
-                PD::setColor(7);
-                PD::print((100*i)/parts);
-                PD::print(" %");
-                
-                // Draw the progress bar.
-                PrintProgressBar(margin, 73, 220-(margin*2), 20, 7, (100*i)/parts);
-
-                PD::update();
-                uint32_t count=file->read(data, Loader.FLASH_WRITE_SIZE);
-                if(!Loader.flash_block(data, i, count ))
-                {
-                    PrintToStatusArea(8, "Sending data to ESP8266 Module Failed");
-                    PD::update();
-                    return false;
-                }
-            }
-            file->close();
-            Loader.flash_end(true);
-            
-            // Remove the flash file.
-            sdFs->remove(path.c_str());
-
-            PrintToStatusArea(11, "Firmware flashed Successfully");
-            PD::update();
-            return true;
-            
+            PrintToStatusArea(8, "Bad line in manifest");
+            UpdateStatusArea();
+            return false;
         }
-        else
-            PrintToStatusArea(8, "Flash Erase Failed");
+        images.push_back({name.substr(nameStart, nameEnd-nameStart+1), offset});
+    }
+    
+    if(images.empty())
+    {
+        PrintToStatusArea(8, "Manifest is empty");
+        UpdateStatusArea();
+        return false;
+    }
+    return true;
+}
 
+// Bring the SD card up, list the images and hand them to a new flash engine.
+// Errors are left in the status area.
+bool startFlashing()
+{
+    // Normally the USB drive is down already, see BTN_A.
+    if(usbmsd_sd)
+    {
+        PrintToStatusArea(11, "Disconnecting USB");
+        UpdateStatusArea();
+        if(!USBDriveStop())
+            *MAGIC_ADDRESS = RESTART_MCU;
+    }
+    
+    // Print to status area
+    PrintToStatusArea(11, "Init SD card");
+    UpdateStatusArea();
+    
+    delete(flashEngine);
+    flashEngine = nullptr;
+    if(!SDInit())
+        return false;
+    
+    std::vector<sFlashImage> images;
+    if(useManifest)
+    {
+        if(!readManifest(ESPManifestName, images))
+            return false;
     }
     else
-        PrintToStatusArea(8, "Can't connect ESP8266 Module");
-
-    PD::update();
+        images.push_back({ESPFlashfileName, 0});
     
-    return false;
+    flashEngine = new FlashEngine(*sdFs, ESPJournalName);
+    statusShown = flashEngine->statusSeq();
+    flashEngine->start(images);
+    return true;
 }
 
-
-
+// Show the flash engine's status when it changes, and how far the journal
+// check or write has got, at most every PROGRESS_INTERVAL_MS. The bar is only drawn
+// for the write.
+void ShowFlashStatus()
+{
+    bool changed = flashEngine->statusSeq()!=statusShown;
+    int32_t percentage = flashEngine->progress();
+    if(changed)
+        progressShown = -1;
+    bool due = percentage>=0 && ProgressDue(percentage);
+    if(!changed && !due)
+        return;
+    statusShown = flashEngine->statusSeq();
+    
+    PrintToStatusArea(flashEngine->statusError() ? 8 : 11, flashEngine->status());
+    PD::setColor(7);
+    if(flashEngine->statusValue()>=0)
+    {
+        PD::print(flashEngine->statusValue());
+        PD::print(flashEngine->statusUnit());
+    }
+    else if(percentage>=0)
+    {
+        PD::print(percentage);
+        PD::print(" %");
+    }
+    UpdateStatusArea();
+    
+    FlashEngine::ePhase phase = flashEngine->phase();
+    if(due && phase>=FlashEngine::PHASE_BLOCKS && phase<=FlashEngine::PHASE_BLOCK_RESYNC)
+    {
+        PrintProgressBar(margin, 73, 220-(margin*2), 20, 7, percentage);
+        PD::update(false, margin, 73, 220-(margin*2), 20);
+    }
+}
@@ -0,0 +1,121 @@
+// Host test for the erase arithmetic of FlashLayout.h.
+//
+// Usage: flash_layout_test
+//
+// eraseSize() is checked against esptool's get_erase_size(), transcribed
+// below, and by hand on a few cases; erasePlan() against a count of the
+// sectors each erase covers.
+#include <mbed.h>
+#include "FlashLayout.h"
+
+static constexpr uint32_t SECTOR=FlashLayout::SECTOR_SIZE;
+static constexpr uint32_t BLOCK=FlashLayout::BLOCK_SIZE;
+
+static int failures=0;
+
+static void check(const bool ok, const char *what)
+{
+    std::printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if(!ok)
+        failures++;
+}
+
+// esptool's ESP8266ROM.get_erase_size().
+static uint32_t esptoolEraseSize(const uint32_t offset, const uint32_t size)
+{
+    uint32_t sectors_per_block=16;
+    uint32_t sector_size=0x1000;
+    uint32_t num_sectors=(size+sector_size-1)/sector_size;
+    uint32_t start_sector=offset/sector_size;
+    uint32_t head_sectors=sectors_per_block-(start_sector%sectors_per_block);
+    if(num_sectors<head_sectors)
+        head_sectors=num_sectors;
+    if(num_sectors<2*head_sectors)
+        return (num_sectors+1)/2*sector_size;
+    return (num_sectors-head_sectors)*sector_size;
+}
+
+// A plan must erase every sector of the range once, and nothing else.
+static bool planCovers(const uint32_t offset, const uint32_t size)
+{
+    FlashLayout::sErasePlan plan=FlashLayout::erasePlan(offset, size);
+    uint32_t first=offset/SECTOR;
+    uint32_t end=(offset+size+SECTOR-1)/SECTOR;
+    uint32_t fullBlocks=0;
+    for(uint32_t sector=(first+15)/16*16;sector+16<=end;sector+=16)
+        fullBlocks++;
+    return plan.blocks==fullBlocks && plan.sectors+plan.blocks*16==end-first;
+}
+
+int main(void)
+{
+    // Sizes to compare against esptool, from the edges of a sector to
+    // several blocks.
+    const uint32_t sizes[]={0, 1, SECTOR-1, SECTOR, SECTOR+1, 3*SECTOR, 8*SECTOR, 15*SECTOR, BLOCK-1, BLOCK, BLOCK+1,
+        BLOCK+SECTOR, 2*BLOCK-SECTOR, 2*BLOCK, 0x25000, 0x4F2A1, 4*BLOCK+0x800, 0x100000};
+
+    // Aligned: at the start of a block.
+    {
+        bool same=true;
+        for(uint32_t size : sizes)
+            same=same && FlashLayout::eraseSize(0x10000, size)==esptoolEraseSize(0x10000, size);
+        check(same, "eraseSize() matches esptool at a block boundary");
+        check(FlashLayout::eraseSize(0, SECTOR)==SECTOR, "one sector at 0 asks for one sector");
+        check(FlashLayout::eraseSize(0, BLOCK)==BLOCK/2, "one block at 0 asks for half of it");
+        check(FlashLayout::eraseSize(0, 0x100000)==0x100000-BLOCK, "1 MB at 0 asks for all but the first block");
+    }
+
+    // Unaligned: on a sector inside a block.
+    {
+        bool same=true;
+        for(uint32_t offset=SECTOR;offset<BLOCK;offset+=SECTOR)
+            for(uint32_t size : sizes)
+                same=same && FlashLayout::eraseSize(offset, size)==esptoolEraseSize(offset, size);
+        check(same, "eraseSize() matches esptool at every sector of a block");
+        check(FlashLayout::eraseSize(0x1000, 2*BLOCK)==0x11000, "two blocks at 0x1000 ask for 17 sectors");
+        check(FlashLayout::eraseSize(0xF000, 3*SECTOR)==2*SECTOR, "3 sectors across a boundary ask for 2");
+    }
+
+    // Sub-block: fewer sectors than are left in the block.
+    {
+        bool same=true;
+        for(uint32_t offset=0;offset<2*BLOCK;offset+=SECTOR)
+            for(uint32_t size=0;size<BLOCK;size+=0x800)
+                same=same && FlashLayout::eraseSize(offset, size)==esptoolEraseSize(offset, size);
+        check(same, "eraseSize() matches esptool below a block");
+        check(FlashLayout::eraseSize(0x3000, 5*SECTOR)==3*SECTOR, "5 sectors at 0x3000 ask for 3");
+        check(FlashLayout::eraseSize(0x3000, 0)==0, "nothing asks for nothing");
+    }
+
+    // Multi-block, up to a 4 MB flash.
+    {
+        bool same=true;
+        for(uint32_t offset=0;offset<0x400000;offset+=0x7000)
+            for(uint32_t size : sizes)
+                same=same && FlashLayout::eraseSize(offset, size)==esptoolEraseSize(offset, size);
+        check(same, "eraseSize() matches esptool across a 4 MB flash");
+    }
+
+    // erasePlan(): the erase timeout is worked out from it.
+    {
+        FlashLayout::sErasePlan plan=FlashLayout::erasePlan(0, BLOCK);
+        check(plan.blocks==1 && plan.sectors==0, "one aligned block is one block erase");
+        plan=FlashLayout::erasePlan(0x3000, 0x25000);
+        check(plan.blocks==1 && plan.sectors==21, "0x25000 at 0x3000: 13 sectors, a block, 8 sectors");
+        plan=FlashLayout::erasePlan(0x1000, BLOCK);
+        check(plan.blocks==0 && plan.sectors==16, "a block's worth off a boundary is all sectors");
+        plan=FlashLayout::erasePlan(0x2000, 0x800);
+        check(plan.blocks==0 && plan.sectors==1, "half a sector is one sector erase");
+        plan=FlashLayout::erasePlan(0x5000, 0);
+        check(plan.blocks==0 && plan.sectors==0, "nothing is no erase");
+
+        bool covers=true;
+        for(uint32_t offset=0;offset<0x200000;offset+=0x5000)
+            for(uint32_t size : sizes)
+                covers=covers && planCovers(offset, size);
+        check(covers, "erasePlan() covers each range exactly");
+    }
+
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+// Host test for the Inflater of Deflate.h, on a real image.
+//
+// Usage: inflate_test <raw file> <zlib stream, 32 KB window> <zlib stream, 4 KB window>
+//
+// Both streams come from zlib itself (see the Makefile). The first one uses
+// zlib's default window, like most pre-deflated images, the second one the
+// window FlashEngine can inflate with.
+#include <mbed.h>
+#include <vector>
+#include "Deflate.h"
+#include "MD5.h"
+
+static constexpr uint32_t WINDOW=0x1000;   // FlashEngine::INFLATE_WINDOW
+static constexpr uint32_t BLOCK=0x400;     // ESPLoader::FLASH_WRITE_SIZE
+
+static int failures=0;
+
+static void check(const bool ok, const char *what)
+{
+    std::printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if(!ok)
+        failures++;
+}
+
+static std::vector<uint8_t> readAll(const char *path)
+{
+    std::vector<uint8_t> data;
+    FILE *file=std::fopen(path, "rb");
+    if(!file)
+        return data;
+    uint8_t buffer[4096];
+    size_t count;
+    while((count=std::fread(buffer, 1, sizeof(buffer), file))>0)
+        data.insert(data.end(), buffer, buffer+count);
+    std::fclose(file);
+    return data;
+}
+
+// A FILE holding the given bytes, for streams made up by the test.
+static FILE *memoryFile(const std::vector<uint8_t> &data)
+{
+    FILE *file=std::tmpfile();
+    std::fwrite(data.data(), 1, data.size(), file);
+    std::rewind(file);
+    return file;
+}
+
+// Inflate the whole stream through a window, size bytes per read(), and hash
+// what comes out. Returns the inflated length.
+static uint32_t inflateAll(FILE *stream, const uint32_t size, uint8_t *digest, bool &done)
+{
+    FileHandle file(stream);
+    std::vector<uint8_t> window(WINDOW);
+    std::vector<uint8_t> block(size);
+    MD5 md5;
+    Inflater inflater(&file);
+    inflater.setWindow(window.data(), window.size());
+    uint32_t total=0;
+    size_t count;
+    while((count=inflater.read(block.data(), size))>0)
+    {
+        md5.update(block.data(), count);
+        total+=count;
+        if(count<size)
+            break;
+    }
+    md5.final(digest);
+    done=inflater.done() && !inflater.failed() && inflater.read(block.data(), size)==0;
+    file.close();
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc!=4)
+    {
+        std::fprintf(stderr, "usage: %s <raw file> <zlib file, 32 KB window> <zlib file, 4 KB window>\n", argv[0]);
+        return 2;
+    }
+    std::vector<uint8_t> raw=readAll(argv[1]);
+    std::vector<uint8_t> wide=readAll(argv[2]);
+    std::vector<uint8_t> narrow=readAll(argv[3]);
+    if(raw.empty() || wide.empty() || narrow.empty())
+    {
+        std::fprintf(stderr, "can't read the input files\n");
+        return 2;
+    }
+    uint8_t rawMd5[MD5::DIGEST_SIZE];
+    MD5 md5;
+    md5.update(raw.data(), raw.size());
+    md5.final(rawMd5);
+
+    // FlashEngine::m_stepPrepare: spot the stream by its header and size it
+    // without a window, whatever window it was made with.
+    {
+        check(Deflate::isZlibHeader(wide.data()), "zlib header recognised");
+        check(Deflate::windowSize(wide.data())==0x8000, "default stream asks for a 32 KB window");
+        check(Deflate::windowSize(narrow.data())==WINDOW, "wbits=12 stream asks for a 4 KB window");
+        uint8_t image[2]={0xE9, 0x03};
+        check(!Deflate::isZlibHeader(image), "ESP image header not taken for zlib");
+
+        FileHandle file(memoryFile(wide));
+        Inflater inflater(&file);
+        check(inflater.run()==raw.size(), "windowless run() sizes a 32 KB window stream");
+        file.close();
+    }
+
+    // The same, a piece per call.
+    {
+        FileHandle file(memoryFile(wide));
+        Inflater inflater(&file);
+        uint32_t total=0;
+        uint32_t calls=0;
+        uint32_t count;
+        while((count=inflater.skip(0x4000))>0)
+        {
+            total+=count;
+            calls++;
+        }
+        check(inflater.done() && !inflater.failed() && total==raw.size(), "windowless skip() in 16 KB pieces sizes the stream");
+        check(calls==(raw.size()+0x3FFF)/0x4000, "skip() stops at the size it was given");
+        check(inflater.consumed()<=wide.size() && inflater.consumed()+4>=wide.size(), "consumed() counts the stream up to its trailer");
+        file.close();
+    }
+
+    // Blocks for FLASH_DATA, as FlashEngine::m_readBlock takes them.
+    {
+        uint8_t digest[MD5::DIGEST_SIZE];
+        bool done;
+        uint32_t total=inflateAll(memoryFile(narrow), BLOCK, digest, done);
+        check(total==raw.size() && done, "4 KB window inflates the whole stream in 1 KB reads");
+        check(std::memcmp(digest, rawMd5, MD5::DIGEST_SIZE)==0, "1 KB reads match the raw file");
+    }
+
+    // Odd read sizes stop in the middle of matches and stored runs.
+    {
+        uint8_t digest[MD5::DIGEST_SIZE];
+        bool done;
+        uint32_t total=inflateAll(memoryFile(narrow), 7, digest, done);
+        check(total==raw.size() && done && std::memcmp(digest, rawMd5, MD5::DIGEST_SIZE)==0, "7 byte reads match the raw file");
+        total=inflateAll(memoryFile(narrow), 1, digest, done);
+        check(total==raw.size() && done && std::memcmp(digest, rawMd5, MD5::DIGEST_SIZE)==0, "1 byte reads match the raw file");
+    }
+
+    // A stream that needs more history than the window must fail, not guess.
+    {
+        uint8_t digest[MD5::DIGEST_SIZE];
+        bool done;
+        uint32_t total=inflateAll(memoryFile(wide), BLOCK, digest, done);
+        check(total==0 && !done, "4 KB window refuses a 32 KB window stream");
+    }
+
+    // A stream cut short fails instead of ending early.
+    {
+        std::vector<uint8_t> cut(narrow.begin(), narrow.begin()+narrow.size()/2);
+        uint8_t digest[MD5::DIGEST_SIZE];
+        bool done;
+        uint32_t total=inflateAll(memoryFile(cut), BLOCK, digest, done);
+        check(total<raw.size() && !done, "truncated stream fails");
+
+        FileHandle file(memoryFile(cut));
+        Inflater inflater(&file);
+        check(inflater.run()==0, "windowless run() fails on a truncated stream");
+        file.close();
+    }
+
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#pragma once
+// Just enough of mbed for the host tests: a FileHandle over a stdio FILE.
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+class FileHandle
+{
+public:
+    explicit FileHandle(FILE *file): m_file(file) {}
+
+    int read(void *buffer, size_t length) { return (int)fread(buffer, 1, length, m_file); }
+    int write(const void *buffer, size_t length) { return (int)fwrite(buffer, 1, length, m_file); }
+    long lseek(long offset, int whence) { return fseek(m_file, offset, whence)==0 ? ftell(m_file) : -1; }
+    long flen(void)
+    {
+        long pos=ftell(m_file);
+        fseek(m_file, 0, SEEK_END);
+        long size=ftell(m_file);
+        fseek(m_file, pos, SEEK_SET);
+        return size;
+    }
+    int close(void) { int ret=fclose(m_file); m_file=nullptr; return ret; }
+
+private:
+    FILE *m_file;
+};